@@ -56,10 +56,23 @@
 # objects for arrays.  The actual data elements can be interpreted
 # as integers directly (for int types).  Strings and BCD arrays
 # behave as expected.
+#
+# A definition is compiled once into a Layout (the offset, type and
+# bitfield mask of everything in it), which is cached by the definition
+# string, and optionally on disk (see set_layout_cache()).  parse()
+# binds that layout to the data; elements are only created as they are
+# used, so binding costs the same no matter how big the definition is.
 
 import struct
 import os
 import logging
+import hashlib
+import tempfile
+
+try:
+    import cPickle as pickle
+except ImportError:
+    import pickle
 
 from chirp import bitwise_grammar
 from chirp.memmap import MemoryMap
@@ -188,8 +201,10 @@ class arrayDataElement(DataElement):
         s += "]"
         return s
 
-    def __init__(self, offset):
-        self.__items = []
+    def __init__(self, offset, items=None):
+        if items is None:
+            items = []
+        self.__items = items
         self._offset = offset
 
     def append(self, item):
@@ -644,8 +659,13 @@ class structDataElement(DataElement):
         return s
 
     def __init__(self, *args, **kwargs):
-        self._generators = {}
-        self._keys = []
+        members = kwargs.pop("members", None)
+        if members is None:
+            self._generators = {}
+            self._keys = []
+        else:
+            self._generators = members
+            self._keys = members.keys()
         self._count = 1
         if "name" in kwargs.keys():
             self._name = kwargs["name"]
@@ -723,6 +743,168 @@ class structDataElement(DataElement):
             yield key, self._generators[key]
 
 
+def _bit_class(subgen, nbits, shift):
+    """Return the bitDataElement class for one bitfield shape"""
+    key = (subgen, nbits, shift)
+    try:
+        return _BIT_CLASSES[key]
+    except KeyError:
+        pass
+
+    class bitDE(bitDataElement):
+        _nbits = nbits
+        _shift = shift
+        _subgen = subgen
+
+    _BIT_CLASSES[key] = bitDE
+    return bitDE
+
+
+_BIT_CLASSES = {}
+
+
+# Layout nodes are plain tuples, so a layout can be pickled.  Offsets
+# in a struct template are relative to where the template is bound.
+#
+#  ("e", type, offset)                  one element
+#  ("b", type, offset, nbits, shift)    a bitfield of a @type
+#  ("A", type, offset, count)           an array of elements
+#  ("B", offset, count)                 a bit array
+#  ("s", name, element)                 a struct
+#  ("S", offset, name, elements)        an array of structs
+#
+# where each struct element is (template, delta, start): the template's
+# members are bound at delta, and the struct itself starts at start.
+# A template is (names, {name: node}).
+def _bind(node, data, delta):
+    kind = node[0]
+    if kind == "e":
+        return node[1](data, node[2] + delta)
+    elif kind == "b":
+        return _bit_class(node[1], node[3], node[4])(data, node[2] + delta)
+    elif kind == "s":
+        return _bind_struct(data, delta, node[1], 1, node[2])
+    else:
+        return arrayDataElement(node[1 if kind != "A" else 2] + delta,
+                                _LazyItems(node, data, delta))
+
+
+def _bind_struct(data, delta, name, count, element):
+    template, tdelta, start = element
+    return structDataElement(data, start + delta, count, name=name,
+                             members=_LazyMembers(template, data,
+                                                  tdelta + delta))
+
+
+class _LazyMembers(dict):
+    """A struct's members, created from its template as they are used"""
+
+    def __init__(self, template, data, delta):
+        dict.__init__(self)
+        self._names, self._nodes = template
+        self._data = data
+        self._delta = delta
+        self._complete = False
+
+    def __missing__(self, key):
+        gen = _bind(self._nodes[key], self._data, self._delta)
+        dict.__setitem__(self, key, gen)
+        return gen
+
+    def __contains__(self, key):
+        return key in self._nodes or dict.__contains__(self, key)
+
+    def _bind_all(self):
+        if not self._complete:
+            for name in self._names:
+                self[name]
+            self._complete = True
+
+    def get(self, key, default=None):
+        if key in self:
+            return self[key]
+        return default
+
+    def keys(self):
+        return list(self._names) + [key for key in dict.keys(self)
+                                    if key not in self._nodes]
+
+    def items(self):
+        self._bind_all()
+        return dict.items(self)
+
+    def values(self):
+        self._bind_all()
+        return dict.values(self)
+
+    def __iter__(self):
+        return iter(self.keys())
+
+    def __len__(self):
+        self._bind_all()
+        return dict.__len__(self)
+
+
+class _LazyItems(object):
+    """An array's items, created from its layout node as they are used"""
+
+    def __init__(self, node, data, delta):
+        self._node = node
+        self._data = data
+        self._delta = delta
+        if node[0] == "S":
+            self._items = [None] * len(node[3])
+        else:
+            self._items = [None] * node[-1]
+
+    def _make(self, index):
+        node = self._node
+        kind = node[0]
+        if kind == "A":
+            return node[1](self._data,
+                           node[2] + index * node[1]._size + self._delta)
+        elif kind == "B":
+            return _bit_class(u8DataElement, 1, 8 - index % 8)(
+                self._data, node[1] + index / 8 + self._delta)
+        else:
+            return _bind_struct(self._data, self._delta, node[2],
+                                len(node[3]), node[3][index])
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return [self[i] for i in range(*index.indices(len(self)))]
+
+        item = self._items[index]
+        if item is None:
+            item = self._items[index] = self._make(index % len(self))
+        return item
+
+    def __len__(self):
+        return len(self._items)
+
+    def __iter__(self):
+        for i in range(0, len(self._items)):
+            yield self[i]
+
+    def append(self, item):
+        self._items.append(item)
+
+    def __repr__(self):
+        return repr(list(self))
+
+
+class Layout:
+    """A compiled definition, which can be bound to any data"""
+
+    def __init__(self, template, offset):
+        self._template = template
+        self._offset = offset
+
+    def bind(self, data):
+        return structDataElement(data, self._offset,
+                                 members=_LazyMembers(self._template, data, 0))
+
+
 class Processor:
 
     _types = {
@@ -747,15 +929,19 @@ class Processor:
     def __init__(self, data, offset):
         self._data = data
         self._offset = offset
-        self._obj = None
         self._user_types = {}
+        self._templates = {}
 
-    def do_symbol(self, symdef, gen):
-        name = symdef[1]
-        self._generators[name] = gen
+    def do_symbol(self, name, node):
+        # As when elements were assigned into a struct, a repeated name
+        # keeps the first definition
+        if name not in self._generators:
+            self._generators[name] = node
+            self._keys.append(name)
 
     def do_bitfield(self, dtype, bitfield):
-        bytes = self._types[dtype](self._data, 0).size() / 8
+        subgen = self._types[dtype]
+        bytes = subgen._size
         bitsleft = bytes * 8
 
         for _bitdef, defn in bitfield:
@@ -764,12 +950,7 @@ class Processor:
             if bitsleft < 0:
                 raise ParseError("Invalid bitfield spec")
 
-            class bitDE(bitDataElement):
-                _nbits = bits
-                _shift = bitsleft
-                _subgen = self._types[dtype]
-
-            self._generators[name] = bitDE(self._data, self._offset)
+            self.do_symbol(name, ("b", subgen, self._offset, bits, bitsleft))
             bitsleft -= bits
 
         if bitsleft:
@@ -778,47 +959,60 @@ class Processor:
 
         return bytes
 
-    def do_bitarray(self, i, count):
-        if count % 8 != 0:
-            raise ValueError("bit array must be divisible by 8.")
-
-        class bitDE(bitDataElement):
-            _nbits = 1
-            _shift = 8 - i % 8
-
-        return bitDE(self._data, self._offset)
-
     def parse_defn(self, defn):
         dtype = defn[0]
 
         if defn[1][0] == "bitfield":
             size = self.do_bitfield(dtype, defn[1][1])
-            count = 1
             self._offset += size
+            return
+
+        if defn[1][0] == "array":
+            sym = defn[1][1][0]
+            count = int(defn[1][1][1][1])
         else:
-            if defn[1][0] == "array":
-                sym = defn[1][1][0]
-                count = int(defn[1][1][1][1])
-            else:
-                count = 1
-                sym = defn[1]
-
-            name = sym[1]
-            res = arrayDataElement(self._offset)
-            size = 0
-            for i in range(0, count):
-                if dtype == "bit":
-                    gen = self.do_bitarray(i, count)
-                    self._offset += int((i+1) % 8 == 0)
-                else:
-                    gen = self._types[dtype](self._data, self._offset)
-                    self._offset += (gen.size() / 8)
-                res.append(gen)
-
-            if count == 1:
-                self._generators[name] = res[0]
-            else:
-                self._generators[name] = res
+            count = 1
+            sym = defn[1]
+
+        name = sym[1]
+        if dtype == "bit":
+            if count % 8 != 0:
+                raise ValueError("bit array must be divisible by 8.")
+            node = ("B", self._offset, count)
+            self._offset += count / 8
+        elif count == 1:
+            node = ("e", self._types[dtype], self._offset)
+            self._offset += self._types[dtype]._size
+        else:
+            node = ("A", self._types[dtype], self._offset, count)
+            self._offset += count * self._types[dtype]._size
+
+        self.do_symbol(name, node)
+
+    def _relocatable(self, block):
+        """Whether @block lays out the same wherever it starts"""
+        for t, d in block:
+            if t == "directive" and d[0][0] in ("seekto", "printoffset"):
+                return False
+            elif t == "struct" and d[0][0] == "struct_decl":
+                inner = d[0][1][:-1]
+                if inner[0][0] == "symbol":
+                    inner = self._user_types.get(inner[0][1])
+                    if inner is None:
+                        return False
+                if not self._relocatable(inner):
+                    return False
+        return True
+
+    def compile_block(self, block):
+        """Compile @block at the current offset into a template"""
+        saved = self._generators, self._keys
+        self._generators = {}
+        self._keys = []
+        self.parse_block(block)
+        template = (tuple(self._keys), self._generators)
+        self._generators, self._keys = saved
+        return template
 
     def parse_struct_decl(self, struct):
         block = struct[:-1]
@@ -833,20 +1027,30 @@ class Processor:
             name = deftype[1]
             count = 1
 
-        result = arrayDataElement(self._offset)
+        # A block without #seekto is compiled once, at offset zero, and
+        # the template shared by every element
+        elements = []
         for i in range(0, count):
-            element = structDataElement(self._data, self._offset, count,
-                                        name=name)
-            result.append(element)
-            tmp = self._generators
-            self._generators = element
-            self.parse_block(block)
-            self._generators = tmp
+            start = self._offset
+            if id(block) in self._templates:
+                _block, template, size = self._templates[id(block)]
+                self._offset += size
+                elements.append((template, start, start))
+            elif self._relocatable(block):
+                self._offset = 0
+                template = self.compile_block(block)
+                # (holding on to block, so its id is not reused)
+                self._templates[id(block)] = block, template, self._offset
+                self._offset += start
+                elements.append((template, start, start))
+            else:
+                elements.append((self.compile_block(block), 0, start))
 
         if count == 1:
-            self._generators[name] = result[0]
+            self.do_symbol(name, ("s", name, elements[0]))
         else:
-            self._generators[name] = result
+            self.do_symbol(name, ("S", elements[0][2], name,
+                                  tuple(elements)))
 
     def parse_struct_defn(self, struct):
         name = struct[0][1]
@@ -881,16 +1085,79 @@ class Processor:
             elif t == "directive":
                 self.parse_directive(d)
 
+    def compile(self, lang):
+        """Compile the parsed definition @lang into a Layout"""
+        offset = self._offset
+        self._generators = None
+        self._keys = None
+        return Layout(self.compile_block(lang), offset)
+
     def parse(self, lang):
-        self._generators = structDataElement(self._data, self._offset)
-        self.parse_block(lang)
-        return self._generators
+        return self.compile(lang).bind(self._data)
+
+
+# Bump this whenever the layout format changes, to ignore stale caches
+LAYOUT_VERSION = 1
+
+_layouts = {}
+_layout_cache_dir = None
+
+
+def set_layout_cache(path):
+    """Keep compiled layouts in the directory @path (or None for none).
+
+    Layouts are pickled, so @path must be somewhere only the user can
+    write to.
+    """
+    global _layout_cache_dir
+    _layout_cache_dir = path
+
+
+def _layout_cache_file(spec, offset):
+    key = hashlib.sha1("%i:%i:%s" % (LAYOUT_VERSION, offset, spec))
+    return os.path.join(_layout_cache_dir, "bitwise-%s" % key.hexdigest())
+
+
+def _load_layout(spec, offset):
+    try:
+        with open(_layout_cache_file(spec, offset), "rb") as f:
+            return pickle.load(f)
+    except Exception:
+        return None
+
+
+def _save_layout(spec, offset, layout):
+    try:
+        fd, tmp = tempfile.mkstemp(dir=_layout_cache_dir)
+        with os.fdopen(fd, "wb") as f:
+            pickle.dump(layout, f, pickle.HIGHEST_PROTOCOL)
+        os.rename(tmp, _layout_cache_file(spec, offset))
+    except Exception, e:
+        LOG.debug("Unable to cache layout: %s" % e)
+
+
+def compile_format(spec, offset=0):
+    """Return the Layout for the definition @spec, compiling it once"""
+    key = (spec, offset)
+    try:
+        return _layouts[key]
+    except KeyError:
+        pass
+
+    layout = None
+    if _layout_cache_dir:
+        layout = _load_layout(spec, offset)
+    if layout is None:
+        layout = Processor(None, offset).compile(bitwise_grammar.parse(spec))
+        if _layout_cache_dir:
+            _save_layout(spec, offset, layout)
+
+    _layouts[key] = layout
+    return layout
 
 
 def parse(spec, data, offset=0):
-    ast = bitwise_grammar.parse(spec)
-    p = Processor(data, offset)
-    return p.parse(ast)
+    return compile_format(spec, offset).bind(data)
 
 if __name__ == "__main__":
     defn = """
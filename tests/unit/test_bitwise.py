@@ -13,7 +13,10 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import os
+import shutil
 import struct
+import tempfile
 import unittest
 from chirp import bitwise
 from chirp import memmap
@@ -254,6 +257,58 @@ class TestBitwiseSeek(BaseTest):
         self.assertEqual(str(obj.bar), "Z")
 
 
+class TestBitwiseLayouts(BaseTest):
+    def test_layout_reused(self):
+        defn = "struct { u8 foo; u8 bar[2]; } baz[3];"
+        self.assertTrue(bitwise.compile_format(defn) is
+                        bitwise.compile_format(defn))
+        a = bitwise.parse(defn, "\x01" * 9)
+        b = bitwise.parse(defn, "\x02" * 9)
+        self.assertEqual(1, a.baz[2].bar[1])
+        self.assertEqual(2, b.baz[2].bar[1])
+        self.assertEqual(7, b.baz[-1].bar._offset)
+        self.assertEqual(2, len(a.baz[1:]))
+
+    def test_struct_array_seekto(self):
+        defn = "struct { char foo; #seekto 5; char bar; } baz[2];"
+        obj = bitwise.parse(defn, "abcdefgh")
+        self.assertEqual("a", str(obj.baz[0].foo))
+        self.assertEqual("g", str(obj.baz[1].foo))
+        self.assertEqual("f", str(obj.baz[1].bar))
+
+    def test_array_str(self):
+        defn = "u8 foo[3]; struct { u8 a; lbcd b[2]; } bar[2];"
+        obj = bitwise.parse(defn, "\x01\x02\x03\x04\x12\x34\x05\x56\x78")
+        self.assertEqual("[0x01, 0x02, 0x03]", str(obj.foo))
+        self.assertEqual("[(lbcdDataElement:1 bytes @ 0004), "
+                         "(lbcdDataElement:1 bytes @ 0005)]",
+                         str(obj.bar[0].b))
+        self.assertEqual("[struct {\n"
+                         "                a: 0x04\n"
+                         "                b: 2:[(3412)]\n"
+                         "} bar (3 bytes at 0x0003)\n"
+                         ", struct {\n"
+                         "                a: 0x05\n"
+                         "                b: 2:[(7856)]\n"
+                         "} bar (3 bytes at 0x0006)\n"
+                         "]", str(obj.bar))
+
+    def test_disk_cache(self):
+        path = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, path)
+        self.addCleanup(bitwise.set_layout_cache, None)
+        bitwise.set_layout_cache(path)
+        defn = "u8 foo; struct { u8 bar:4, baz:4; } qux[2];"
+        bitwise.compile_format(defn, 1)
+        self.assertEqual(1, len(os.listdir(path)))
+
+        del bitwise._layouts[(defn, 1)]
+        obj = bitwise.parse(defn, "\x00\x01\x23\x45", 1)
+        self.assertEqual(1, obj.foo)
+        self.assertEqual(3, obj.qux[0].baz)
+        self.assertEqual(4, obj.qux[1].bar)
+
+
 class TestBitwiseErrors(BaseTest):
     def test_missing_semicolon(self):
         self.assertRaises(SyntaxError, bitwise.parse, "u8 foo", "")
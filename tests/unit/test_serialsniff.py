@@ -0,0 +1,364 @@
+# Copyright 2008 Dan Smith <dsmith@danplanet.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+import errno
+import fcntl
+import json
+import os
+import select
+import shutil
+import sys
+import tempfile
+import time
+import tty
+
+from tests.unit import base
+
+TOOLS = os.path.join(os.path.dirname(__file__), '..', '..', 'tools')
+sys.path.insert(0, os.path.abspath(TOOLS))
+import serialsniff  # noqa
+
+
+class PtyPipe(object):
+    """Just enough of a serial.Serial for a driver, on a pty"""
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        self.timeout = 1
+        self.baudrate = 9600
+        self.parity = 'N'
+
+    def read(self, count):
+        data = b''
+        end = time.time() + self.timeout
+        while len(data) < count:
+            ready = select.select([self.fd], [], [],
+                                  max(0, end - time.time()))[0]
+            if not ready:
+                break
+            data += os.read(self.fd, count - len(data))
+        return data
+
+    def write(self, data):
+        os.write(self.fd, data)
+
+    def flush(self):
+        pass
+
+    def close(self):
+        os.close(self.fd)
+
+
+class SerialSniffTest(base.BaseTest):
+    def setUp(self):
+        super(SerialSniffTest, self).setUp()
+        if not serialsniff.find_library():
+            self.skipTest('libserialsniff is not built')
+
+    def test_proxy_chunks(self):
+        chunks = []
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+
+        session = serialsniff.Session(window=10, quiescent=True)
+        session.add_pair(master_a, master_b)
+        session.on_chunk(lambda c: chunks.append((c.name,
+                                                  c.data.tobytes())))
+        with session:
+            os.write(slave_a, b'hello')
+            select.select([slave_b], [], [], 5)
+            self.assertEqual(b'hello', os.read(slave_b, 5))
+            # time.sleep() is stubbed out for the whole test run
+            for i in range(50):
+                if chunks:
+                    break
+                select.select([], [], [], 0.1)
+            self.assertEqual([('A', b'hello')], chunks)
+
+        os.close(slave_a)
+        os.close(slave_b)
+        self.assertEqual([('A', b'hello')], chunks)
+
+    def test_sessions_in_sequence(self):
+        self.assertRaises(serialsniff.SerialSniffError,
+                          serialsniff.Session, no_such_option=True)
+        self.assertRaises(serialsniff.SerialSniffError,
+                          serialsniff.Session, window=True)
+        self.assertRaises(serialsniff.SerialSniffError,
+                          serialsniff.Session, image=True)
+
+        for i in range(2):
+            master_a, slave_a = os.openpty()
+            master_b, slave_b = os.openpty()
+            tty.setraw(slave_a)
+            tty.setraw(slave_b)
+
+            session = serialsniff.Session(quiescent=True)
+            session.add_pair(master_a, master_b)
+            self.addCleanup(session.close)
+            # The stop that ends one run must not end the next
+            for run in range(2):
+                session.start()
+                os.write(slave_a, b'%i.%i' % (i, run))
+                select.select([slave_b], [], [], 5)
+                self.assertEqual(b'%i.%i' % (i, run), os.read(slave_b, 3))
+                self.assertEqual(0, session.stop())
+            session.close()
+
+            os.close(slave_a)
+            os.close(slave_b)
+
+    def test_uring(self):
+        tmpdir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmpdir)
+        log = os.path.join(tmpdir, 'a.log')
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+
+        try:
+            session = serialsniff.Session(window=10, quiescent=True,
+                                          uring=True, logA=log)
+        except serialsniff.SerialSniffError:
+            self.skipTest('libserialsniff is built without io_uring')
+        session.add_pair(master_a, master_b)
+        with session:
+            os.write(slave_a, b'hello')
+            select.select([slave_b], [], [], 5)
+            self.assertEqual(b'hello', os.read(slave_b, 5))
+            os.write(slave_b, b'world')
+            select.select([slave_a], [], [], 5)
+            self.assertEqual(b'world', os.read(slave_a, 5))
+
+            # Hanging up A ends the pair, and with it the run
+            os.close(slave_a)
+            session._thread.join(5)
+            self.assertFalse(session._thread.is_alive())
+
+        os.close(slave_b)
+        self.assertEqual(b'hello', open(log, 'rb').read())
+
+    def test_vpairs(self):
+        tmpdir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmpdir)
+        state = os.path.join(tmpdir, 'state.json')
+        session = serialsniff.Session(vpairs=2, state_file=state,
+                                      quiescent=True)
+        with session:
+            # time.sleep() is stubbed out for the whole test run
+            for i in range(50):
+                if os.path.exists(state):
+                    break
+                select.select([], [], [], 0.1)
+            pairs = json.load(open(state))['pairs']
+            self.assertEqual(2, len(pairs))
+            self.assertEqual(session.pty('B1'), pairs[1]['B']['path'])
+
+            a = PtyPipe(pairs[1]['A']['path'])
+            b = PtyPipe(pairs[1]['B']['path'])
+            a.write(b'no newline')
+            self.assertEqual(b'no newline', b.read(10))
+            a.close()
+            b.close()
+
+        self.assertFalse(os.path.exists(state))
+
+    def test_vpairs_per_test(self):
+        # Tests running side by side each bridge a pair of their own
+        sessions = [serialsniff.Session(vpairs=1, quiescent=True)
+                    for i in range(4)]
+        for session in sessions:
+            session.start()
+            self.addCleanup(session.close)
+
+        ports = [(PtyPipe(s.pty('A')), PtyPipe(s.pty('B')))
+                 for s in sessions]
+        for i, (a, b) in enumerate(ports):
+            a.write(b'test %i' % i)
+        for i, (a, b) in enumerate(ports):
+            self.assertEqual(b'test %i' % i, b.read(6))
+            a.close()
+            b.close()
+
+    def test_fault_injection(self):
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+
+        session = serialsniff.Session(window=10, quiescent=True,
+                                      faultA='delay=200,flip=1,seed=1')
+        session.add_pair(master_a, master_b)
+        with session:
+            start = time.time()
+            os.write(slave_a, b'\x00' * 4)
+            select.select([slave_b], [], [], 5)
+            elapsed = time.time() - start
+            data = os.read(slave_b, 4)
+
+        os.close(slave_a)
+        os.close(slave_b)
+        self.assertTrue(elapsed >= 0.2)
+        self.assertEqual(4, len(data))
+        # Every byte has had exactly one bit flipped
+        for byte in bytearray(data):
+            self.assertEqual(1, bin(byte).count('1'))
+
+    def test_fault_baud_holds_up(self):
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+        fcntl.fcntl(slave_a, fcntl.F_SETFL,
+                    fcntl.fcntl(slave_a, fcntl.F_GETFL) | os.O_NONBLOCK)
+        # More than the fault queue (FAULT_MAX) holds, in about a second
+        data = bytes(bytearray(i % 251 for i in range(5 * 1024 * 1024)))
+
+        session = serialsniff.Session(window=10, quiescent=True, digits=0,
+                                      faultA='baud=50000000')
+        session.add_pair(master_a, master_b)
+        with session:
+            received = self._pump(slave_a, slave_b, data)
+
+        os.close(slave_a)
+        os.close(slave_b)
+        self.assertEqual(len(data), len(received))
+        self.assertEqual(data, received)
+
+    def _stall_b(self, session):
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+        fcntl.fcntl(slave_a, fcntl.F_SETFL,
+                    fcntl.fcntl(slave_a, fcntl.F_GETFL) | os.O_NONBLOCK)
+        data = bytes(bytearray(i % 251 for i in range(3 * 1024 * 1024)))
+
+        session.add_pair(master_a, master_b)
+        with session:
+            # Nobody reads B, so A is eventually held up rather than
+            # having what it sent thrown away
+            sent = 0
+            while (sent < len(data) and
+                   select.select([], [slave_a], [], 1)[1]):
+                try:
+                    sent += os.write(slave_a, data[sent:sent + 65536])
+                except OSError as e:
+                    if e.errno != errno.EAGAIN:
+                        raise
+            self.assertTrue(sent < len(data))
+            received = self._pump(slave_a, slave_b, data, sent)
+
+        os.close(slave_a)
+        os.close(slave_b)
+        self.assertEqual(data, received)
+        return sent
+
+    def _pump(self, slave_a, slave_b, data, sent=0):
+        """Send the rest of @data into A while reading all of it from B"""
+        received = []
+        total = 0
+        while total < len(data):
+            want = [slave_a] if sent < len(data) else []
+            r, w, x = select.select([slave_b], want, [], 5)
+            if not r and not w:
+                break
+            if w:
+                try:
+                    sent += os.write(slave_a, data[sent:sent + 65536])
+                except OSError as e:
+                    if e.errno != errno.EAGAIN:
+                        raise
+            if r:
+                received.append(os.read(slave_b, 65536))
+                total += len(received[-1])
+
+        return b''.join(received)
+
+    def test_stalled_reader(self):
+        session = serialsniff.Session(window=10, quiescent=True, digits=0)
+        # Held up once B has a full queue (OUTQ_MAX) waiting for it
+        self.assertTrue(self._stall_b(session) > 1024 * 1024)
+
+    def test_stalled_reader_uring(self):
+        try:
+            session = serialsniff.Session(window=10, quiescent=True,
+                                          digits=0, uring=True)
+        except serialsniff.SerialSniffError:
+            self.skipTest('libserialsniff is built without io_uring')
+        self._stall_b(session)
+
+    def _proxy_a(self, messages, **options):
+        master_a, slave_a = os.openpty()
+        master_b, slave_b = os.openpty()
+        tty.setraw(slave_a)
+        tty.setraw(slave_b)
+
+        session = serialsniff.Session(window=10, quiescent=True, **options)
+        session.add_pair(master_a, master_b)
+        session.start()
+        for message in messages:
+            os.write(slave_a, message)
+            select.select([slave_b], [], [], 5)
+            os.read(slave_b, len(message))
+        result = session.stop()
+        session.close()
+
+        os.close(slave_a)
+        os.close(slave_b)
+        return result
+
+    def test_compare(self):
+        tmpdir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, tmpdir)
+        golden = os.path.join(tmpdir, 'golden.cap')
+        messages = [b'PROGRAM', b'\x02', b'R\x00\x00\x10']
+
+        self.assertEqual(0, self._proxy_a(messages, capture=golden))
+        self.assertEqual(0, self._proxy_a(messages, compare=golden))
+        self.assertEqual(serialsniff.SS_EDIVERGED,
+                         self._proxy_a(messages[:2] + [b'R\x00\x10\x10'],
+                                       compare=golden))
+        # Stopping short of the golden stream is a regression too
+        self.assertEqual(serialsniff.SS_EDIVERGED,
+                         self._proxy_a(messages[:2], compare=golden))
+
+    def test_emulated_clone(self):
+        from chirp import directory
+        from chirp.drivers import baofeng_common
+
+        self.mox.stubs.Set(baofeng_common.time, 'sleep', lambda s: None)
+        image = os.path.join(os.path.dirname(__file__), '..', 'images',
+                             'Baofeng_UV-6R.img')
+        capture = tempfile.NamedTemporaryFile(suffix='.cap')
+        cls = directory.get_radio('Baofeng_UV-6R')
+
+        with serialsniff.Session(emulate='baofeng', image=image,
+                                 ack_block=0,
+                                 capture=capture.name) as session:
+            pipe = PtyPipe(session.pty('radio'))
+            radio = cls(pipe)
+            radio.status_fn = lambda s: None
+            radio.sync_in()
+            pipe.close()
+
+        ref = cls(image)
+        size = len(ref.get_mmap().get_packed())
+        self.assertEqual(ref.get_mmap().get_packed(),
+                         radio.get_mmap().get_packed()[:size])
+        self.assertTrue(os.path.getsize(capture.name) > size)
@@ -0,0 +1,6941 @@
+/*
+ *
+ * Copyright 2008 Dan Smith <dsmith@danplanet.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *
+ * Modifications made by:
+ *	Stuart Blake Tener, N3GWG
+ *	Email:		<teners@bh90210.net>
+ *	Mobile phone:	+1 (310) 358-0202
+ *
+ * 02 MAR 2009 - Version 1.01
+ *
+ *		Logic was changed to use "ptsname" instead of "ptsname_r"
+ *		in pursuance of provisioning greater compatibility with other
+ *		Unix variants and Open Standards Unix flavors which have not
+ *		otherwise implemented the "ptsname_r" system call.
+ *		Changes developed and tested under MacOS 10.5.6 (Leopard)
+ *
+ *		Added "--quiescent" switch, which when used on the command
+ *		line prevents the printing of "Timeout" and count notices
+ *		on the console.
+ *		Changes developed and tested under MacOS 10.5.6 (Leopard)
+ *
+ *		Added program title and version tagline, printed when the
+ *		software is first started.
+ *
+ * 03 MAR 2009 - Version 1.02
+ *
+ *		Added "--digits" switch, which when used on the command
+ *		line allows for setting the number of hex digits print per
+ *		line.
+ *
+ *		Added code to allow "-q" shorthand for "quiescent mode".
+ *
+ *		Changes were made to add "#ifdef" statements so that only code
+ *		appropriate to MacOS would be compiled if a "#define MACOS" is
+ *		defined early within the source code.
+ *
+ *		Cleaned up comments in the source for my new source code.
+ *
+ *		Changes developed and tested under MacOS 10.5.6 (Leopard)
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/version.h>
+/* Provided buffer rings (IORING_REGISTER_PBUF_RING) are from 5.19 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING
+#endif
+#endif
+#endif
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "libserialsniff.h"
+
+#define STREQ(a,b) (strcmp(a,b) == 0)
+
+static char	*version = "1.02 (03 MAR 2009)";
+#define CHUNK_SIZE	4096
+#define OUTQ_MAX	(1024 * 1024)	/* Queued for a path before its peer waits */
+
+enum source_type {
+	SRC_PATH,
+	SRC_TIMER,
+	SRC_TICK,
+	SRC_LISTEN,
+	SRC_OBSERVER,
+	SRC_SIGNAL,
+	SRC_STOP,
+	SRC_FAULT,
+	SRC_URING,
+};
+
+/*
+ * Everything registered with epoll carries a pointer to one of these,
+ * so the event loop can tell what became ready without a lookup.
+ */
+struct source {
+	enum source_type type;
+	struct path *path;
+	void *priv;
+};
+
+/*
+ * Bytes waiting to be written to a path whose descriptor would have
+ * blocked.  They are drained when epoll reports the path writable.
+ */
+struct outq {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * Per-direction protocol decoder state.  Decoders consume the stream a
+ * byte at a time and keep only the frame being assembled, so decoding
+ * is linear in the data and never rescans.  Owned by the dump thread.
+ */
+#define DEC_MAX		1024
+
+struct decoder {
+	int state;
+	size_t want;
+	size_t len;
+	unsigned char buf[DEC_MAX];
+	size_t junk;
+	unsigned long frames;
+};
+
+struct protocol {
+	const char *name;
+	void (*feed)(struct decoder *dec, const char *name,
+		     const unsigned char *buf, size_t len);
+};
+
+/*
+ * Power-of-two histogram: bucket 0 counts zeros, bucket n counts
+ * values in [2^(n-1), 2^n).  The last bucket takes everything larger.
+ */
+#define HIST_BUCKETS	32
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct stats {
+	uint64_t bytes;
+	uint64_t reads;
+	uint64_t last_ns;		/* Time of the last read */
+	uint64_t interval_bytes;	/* Bytes since the last tick */
+	uint64_t rate;			/* Bytes/s over the last tick */
+	uint64_t peak_rate;
+	struct hist chunk;		/* Bytes per reported chunk */
+	struct hist gap;		/* us between reads on this path */
+	struct hist turnaround;		/* us from the peer's last read */
+};
+
+struct path {
+	int fd;
+	int hold_fd;
+	char path[1024];
+	char name[1024];
+	int rawlog_fd;
+	const char *log_name;
+	uint64_t log_bytes;
+	uint64_t log_opened;
+	struct path *peer;
+	bool closed;
+	bool hungup;		/* Read to the end, even if throttled */
+	int index;
+	int dir;
+	bool kernel_ts;		/* The socket reports when data arrived */
+
+	const char *tty_spec;
+	struct termios saved_tios;
+	bool tios_saved;
+
+	struct source io_src;
+	struct source timer_src;
+	int timer_fd;
+
+	/* Bytes read since the coalescing window was opened */
+	char chunk[CHUNK_SIZE];
+	int chunk_len;
+	int chunk_total;
+	struct timespec chunk_ts;
+
+	struct decoder *dec;
+	struct stats stats;
+	struct fault *fault;
+
+	struct outq out;
+
+	/*
+	 * With --uring, the write to the descriptor and the raw log append
+	 * in flight, and what has gathered for the log since.  ubuf is the
+	 * read buffer where multishot reads are not available.  A read is
+	 * held (not re-armed) while the peer is too far behind.
+	 */
+	struct outq sending;
+	struct outq logging;
+	struct outq log_out;
+	bool rotate_due;
+	char *ubuf;
+	bool read_armed;
+	bool read_held;
+
+	/*
+	 * In splice mode, data read from this path sits in fwd_pipe until
+	 * it has been spliced to the peer.  log_pipe and tap_pipe receive
+	 * tee()d references for the raw log and the display sample.
+	 */
+	bool splice;
+	int fwd_pipe[2];
+	int log_pipe[2];
+	int tap_pipe[2];
+	int cap_pipe[2];
+	int pipe_len;
+	int tap_len;
+};
+
+/*
+ * A pair is one A<->B link.  Any number of pairs may be proxied by a
+ * single process; each keeps its own names and logs.
+ */
+struct pair {
+	struct path A;
+	struct path B;
+	unsigned int set;
+};
+
+#define PAIR_A		(1 << 0)
+#define PAIR_B		(1 << 1)
+#define PAIR_LOGA	(1 << 2)
+#define PAIR_LOGB	(1 << 3)
+#define PAIR_NAMEA	(1 << 4)
+#define PAIR_NAMEB	(1 << 5)
+#define PAIR_TTYA	(1 << 6)
+#define PAIR_TTYB	(1 << 7)
+#define PAIR_FAULTA	(1 << 8)
+#define PAIR_FAULTB	(1 << 9)
+
+#define MAX_EVENTS	64
+
+/*
+ * Chunks are handed from the forwarding loop to the dump thread through
+ * a single-producer/single-consumer ring of variable sized records.  If
+ * the ring is full the chunk is dropped (and counted) rather than
+ * stalling the link.  A record with size 0 means "skip to the start".
+ */
+struct dump_rec {
+	uint32_t size;
+	int len;
+	int count;
+	bool timeout;
+	const struct path *path;
+	struct timespec ts;
+};
+
+#define REC_ALIGN(x)	(((x) + 7) & ~((size_t)7))
+
+struct dump_ring {
+	char *buf;
+	size_t size;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic unsigned long dropped;
+	_Atomic bool waiting;
+	_Atomic bool stop;
+	int wake_fd;
+	pthread_t thread;
+};
+
+
+/*
+ * Capture files interleave both directions of every pair.  The file is
+ * a sequence of fixed size blocks, each starting with a block header.
+ * Records (a header plus data, padded to CAP_ALIGN) never straddle a
+ * block, so a reader can binary search the block headers by time and
+ * start parsing at any block.  All fields are little endian.
+ */
+#define CAP_MAGIC	"SSNIFCAP"
+#define CAP_VERSION	1
+#define CAP_BLOCK	(64 * 1024)
+#define CAP_ALIGN(x)	(((x) + 15) & ~((size_t)15))
+#define CAP_DIR_A	0
+#define CAP_DIR_B	1
+#define CAP_DIR_PAD	0xFF
+
+struct cap_block {
+	char magic[8];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t block_size;
+	uint64_t block_no;
+	uint64_t first_ts;	/* ns, of the first record in this block */
+};
+
+struct cap_rec {
+	uint64_t ts;		/* CLOCK_MONOTONIC_RAW ns */
+	uint32_t len;
+	uint8_t dir;
+	uint8_t pair;
+	uint16_t reserved;
+};
+
+struct capture {
+	int fd;
+	char *buf;
+	size_t len;		/* bytes buffered, not yet written */
+	uint64_t pos;		/* logical file size including buffer */
+};
+
+/*
+ * The state of the rest of the engine, which a session embeds.  Each
+ * part is described with its code below.
+ */
+struct pcapng {
+	int fd;
+	char *buf;
+	size_t len;
+	uint64_t epoch;		/* CLOCK_REALTIME - CLOCK_MONOTONIC_RAW, ns */
+};
+
+struct cap_reader {
+	const char *map;
+	size_t size;
+	const char *buf;	/* The current block */
+	size_t len;
+	size_t off;
+	uint64_t block;
+	uint64_t nblocks;
+	uint64_t released;	/* Everything before this has been dropped */
+	uint64_t base;		/* timestamp of the first record */
+};
+
+#ifdef HAVE_URING
+struct uring {
+	int fd;
+	unsigned int entries;
+	bool multishot;
+	bool stopping;		/* Reads are no longer re-armed */
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_flags;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_pending;	/* Prepared but not yet submitted */
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/* Provided buffers for multishot reads, CHUNK_SIZE each */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+
+	struct source src;
+};
+#else
+struct uring {
+	int fd;
+};
+#endif
+
+struct observer {
+	struct source src;
+	int fd;
+	struct outq q;
+	unsigned long dropped;
+	char name[64];
+	struct observer *next;
+};
+
+struct observe_srv {
+	int fd;
+	int epfd;
+	struct source src;
+	struct observer *clients;
+	size_t qmax;
+};
+
+#define PATTERN_MAX	64
+
+struct pattern_tail {
+	unsigned char buf[PATTERN_MAX];
+	size_t len;
+};
+
+struct trigger {
+	char *spec;
+	int dir;
+	unsigned char pat[PATTERN_MAX];
+	unsigned char mask[PATTERN_MAX];
+	size_t patlen;
+	size_t min_len;
+	size_t max_len;
+	struct pattern_tail *tails;
+	struct trigger *next;
+};
+
+struct held_rec {
+	uint32_t size;
+	uint32_t len;
+	uint64_t ts;
+	const struct path *src;
+};
+
+struct filter {
+	struct trigger *triggers;
+	uint64_t pre_ns;
+	uint64_t post_ns;
+	uint64_t post_until;
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	unsigned long fired;
+	uint64_t committed;
+	uint64_t discarded;
+};
+
+struct compare {
+	struct cap_reader r;
+	bool open;
+	const char *data;	/* The golden record being matched */
+	uint32_t len;
+	uint32_t off;
+	uint64_t ts;
+	uint64_t golden_start;
+	uint64_t live_start;
+	uint64_t offset;	/* Bytes matched so far */
+	int64_t delta_ns;	/* Live minus golden, at the last record */
+	int64_t worst_ns;
+	bool diverged;
+	bool slow;
+};
+
+struct rotated {
+	char *name;
+	int fd;
+	struct rotated *next;
+};
+
+struct rotator {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rotated *head;
+	struct rotated **tail;
+	bool stop;
+	bool running;
+	pthread_t thread;
+};
+
+/*
+ * Everything the engine knows lives in the session: its settings, its
+ * pairs and the state of every part of the engine.  Nothing it changes
+ * is kept at file scope, so a process may hold any number of sessions
+ * and run each of them (on a thread of its own) as often as it likes.
+ */
+struct ss_session {
+	ss_chunk_fn chunk_fn;
+	void *chunk_opaque;
+	ss_pty_fn pty_fn;
+	void *pty_opaque;
+	bool catch_signals;
+	int stop_fd;
+	struct source stop_src;
+
+	/* Settings, with their defaults in reset_engine() */
+	int quiescent;
+	int total_hex;
+	int window_ms;
+	bool use_splice;
+	int splice_sample;
+	unsigned int uring_entries;
+	bool timestamps;
+	size_t ring_size;
+	char *read_file;
+	double read_from;
+	double read_to;
+	char *analyze_file;
+	uint64_t session_gap_ns;
+	uint64_t idle_gap_ns;
+	char *compare_file;
+	int compare_dir;
+	int compare_pair;
+	uint64_t compare_slack_ns;
+	char *replay_file;
+	double replay_speed;
+	int replay_dir;
+	int replay_pair;
+	bool lockstep;
+	char *emulate;
+	char *image_file;
+	char *save_file;
+	size_t mem_size;
+	bool ack_block;
+	int magic_len;
+	char icom_model[4];
+	const struct protocol *decode;
+	int stats_interval;
+	char *stats_file;
+	uint64_t rotate_size;
+	int rotate_secs;
+	const char *compressor;
+	char *state_file;
+
+	struct pair *pairs;
+	int npairs;
+
+	struct dump_ring ring;
+	struct timespec start_ts;
+	char *hex;			/* hexdump()'s buffers */
+	size_t hex_size;
+	char *hex_out;
+	size_t hex_out_size;
+	int stats_ticks;
+
+	struct capture capture;
+	struct pcapng pcapng;
+	int pcapng_linktype;
+	int tick_fd;
+	struct source tick_src;
+
+	/*
+	 * SIGINT, SIGTERM and SIGHUP are blocked in every thread and
+	 * delivered to the event loop through a signalfd, so a stop request
+	 * is handled between events and nothing already read is lost.
+	 */
+	sigset_t shutdown_sigs;
+	sigset_t saved_sigs;
+	bool sigs_saved;
+	int signal_fd;
+	struct source signal_src;
+
+	struct uring uring;
+	struct observe_srv observe;
+	struct filter filter;
+	struct compare compare;
+	struct rotator rotator;
+};
+
+static char hex_table[256][2];
+static char ascii_table[256];
+static pthread_once_t hexdump_once = PTHREAD_ONCE_INIT;
+
+static void hexdump_init(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		hex_table[i][0] = digits[i >> 4];
+		hex_table[i][1] = digits[i & 0xF];
+		ascii_table[i] = ((i > ' ') && (i < '~')) ? i : '.';
+	}
+}
+
+/*
+ * Convert @len bytes to 2 * @len lowercase hex digits.  The vector
+ * paths turn each nibble into ASCII with a compare and an add, sixteen
+ * (or thirty-two) bytes at a time; the tail goes through hex_table.
+ */
+static void hex_encode(const unsigned char *src, int len, char *dst)
+{
+	int i = 0;
+
+#if defined(__AVX2__)
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	const __m256i nine = _mm256_set1_epi8(9);
+	const __m256i zero = _mm256_set1_epi8('0');
+	const __m256i gap = _mm256_set1_epi8('a' - '0' - 10);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		__m256i lo = _mm256_and_si256(v, mask);
+		__m256i a, b;
+
+		hi = _mm256_add_epi8(_mm256_add_epi8(hi, zero),
+			_mm256_and_si256(_mm256_cmpgt_epi8(hi, nine), gap));
+		lo = _mm256_add_epi8(_mm256_add_epi8(lo, zero),
+			_mm256_and_si256(_mm256_cmpgt_epi8(lo, nine), gap));
+
+		/* unpack works per 128-bit lane, so fix up the order */
+		a = _mm256_unpacklo_epi8(hi, lo);
+		b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i),
+				    _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i + 32),
+				    _mm256_permute2x128_si256(a, b, 0x31));
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i mask16 = _mm_set1_epi8(0x0F);
+	const __m128i nine16 = _mm_set1_epi8(9);
+	const __m128i zero16 = _mm_set1_epi8('0');
+	const __m128i gap16 = _mm_set1_epi8('a' - '0' - 10);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask16);
+		__m128i lo = _mm_and_si128(v, mask16);
+
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero16),
+			_mm_and_si128(_mm_cmpgt_epi8(hi, nine16), gap16));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero16),
+			_mm_and_si128(_mm_cmpgt_epi8(lo, nine16), gap16));
+
+		_mm_storeu_si128((__m128i *)(dst + 2 * i),
+				 _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+				 _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+
+	for (; i < len; i++) {
+		dst[2 * i] = hex_table[src[i]][0];
+		dst[2 * i + 1] = hex_table[src[i]][1];
+	}
+}
+
+static void hexdump(struct ss_session *s, char *buf, int len, FILE *dest)
+{
+	/*
+	 * In precedence to the modification of this procedure to support the
+	 * variable size hexadecimal output, the total bytes output was fixed
+	 * to be a length of 8.
+	 *
+	 * The amendment of this procedure to support the "total_hex" variable
+	 * allows for the user to pass a command line argument instantiating a
+	 * desired number of hexadecimal bytes (and their ASCII equivelent) to
+	 * be displayed.
+	 *
+	 * The whole dump is rendered into one buffer and written with a
+	 * single fwrite(), rather than one fprintf() per character.
+	 *
+	 */
+
+	const unsigned char *ubuf = (const unsigned char *)buf;
+	char *hex;
+	char *out;
+	size_t lines;
+	size_t need;
+	char *p;
+	int i;
+	int j;
+
+	if ((len <= 0) || (s->total_hex <= 0))
+		return;
+
+	lines = (len + s->total_hex - 1) / s->total_hex;
+	need = lines * (s->total_hex * 4 + (s->total_hex / 4 + 1) * 2 + 4);
+
+	if ((s->hex_size < (size_t)len * 2 + 64) ||
+	    (s->hex_out_size < need)) {
+		s->hex_size = (size_t)len * 2 + 64;
+		s->hex_out_size = need;
+		s->hex = realloc(s->hex, s->hex_size);
+		s->hex_out = realloc(s->hex_out, s->hex_out_size);
+		if (!s->hex || !s->hex_out) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	hex = s->hex;
+	out = s->hex_out;
+	hex_encode(ubuf, len, hex);
+
+	p = out;
+	for (i = 0; i < len; i += s->total_hex) {
+		for (j = i; j < i + s->total_hex; j++) {
+			if ((j % 4) == 0)
+				*p++ = ' ';
+
+			if (j < len) {
+				*p++ = hex[2 * j];
+				*p++ = hex[2 * j + 1];
+			} else {
+				*p++ = '-';
+				*p++ = '-';
+			}
+		}
+
+		memcpy(p, "   ", 3);
+		p += 3;
+
+		for (j = i; j < i + s->total_hex; j++) {
+			if ((j % 4) == 0)
+				*p++ = ' ';
+
+			if (j < len)
+				*p++ = ascii_table[ubuf[j]];
+			else
+				*p++ = '.';
+		}
+
+		*p++ = '\n';
+	}
+
+	fwrite(out, 1, p - out, dest);
+}
+
+static void dec_reset(struct decoder *dec)
+{
+	dec->state = 0;
+	dec->want = 0;
+	dec->len = 0;
+}
+
+/* Account for bytes that are not part of any frame, reported in runs */
+static void dec_junk(struct decoder *dec, const char *name)
+{
+	if (dec->junk) {
+		printf("%s: %zu unframed byte%s\n", name, dec->junk,
+		       dec->junk == 1 ? "" : "s");
+		dec->junk = 0;
+	}
+}
+
+static void dec_hex(const unsigned char *buf, size_t len, size_t max)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && (i < max); i++)
+		printf("%02X", buf[i]);
+	if (len > max)
+		printf("...");
+}
+
+static unsigned char icom_checksum(const unsigned char *data, size_t len);
+static int unhex(unsigned char c);
+
+/*
+ * Icom clone data (E4) payloads are the BCD of addr, size, data and a
+ * checksum.  The address is two bytes, or four for radios with more
+ * than 64KiB of memory; whichever makes the checksum work wins.
+ */
+static void icom_show_clone(const unsigned char *payload, size_t len)
+{
+	unsigned char raw[DEC_MAX / 2];
+	size_t n = 0;
+	size_t hdr;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		int hi = unhex(payload[i]);
+		int lo = unhex(payload[i + 1]);
+
+		if ((hi < 0) || (lo < 0)) {
+			printf(" (not BCD)");
+			return;
+		}
+		raw[n++] = (hi << 4) | lo;
+	}
+
+	for (hdr = 3; hdr <= 5; hdr += 2) {
+		size_t addr = 0;
+		size_t size;
+
+		if (n < hdr + 1)
+			break;
+
+		size = raw[hdr - 1];
+		if ((hdr + size + 1 != n) ||
+		    (icom_checksum(raw, hdr + size) != raw[hdr + size]))
+			continue;
+
+		for (i = 0; i < hdr - 1; i++)
+			addr = (addr << 8) | raw[i];
+		printf(" addr=0x%04zx len=%zu", addr, size);
+		return;
+	}
+
+	printf(" (bad checksum)");
+}
+
+static void icom_show(const char *name, const unsigned char *f, size_t len)
+{
+	static const char *const cmds[] = {
+		[0x00] = "model query",
+		[0x01] = "model",
+		[0x02] = "clone out",
+		[0x03] = "clone in",
+		[0x04] = "clone data",
+		[0x05] = "clone end",
+		[0x06] = "clone result",
+	};
+	unsigned char cmd = f[2];
+	const char *what = NULL;
+
+	if ((cmd >= 0xE0) && (cmd <= 0xE6))
+		what = cmds[cmd - 0xE0];
+
+	printf("%s: icom %02X>%02X %02X", name, f[0], f[1], cmd);
+	if (what)
+		printf(" %s", what);
+
+	if (cmd == 0xE4) {
+		icom_show_clone(f + 3, len - 3);
+	} else if ((cmd == 0xE5) || (cmd == 0xE6)) {
+		printf(" \"");
+		fwrite(f + 3, 1, len - 3, stdout);
+		printf("\"");
+	} else if (len > 3) {
+		printf(" ");
+		dec_hex(f + 3, len - 3, 32);
+	}
+	printf("\n");
+}
+
+enum {
+	ICOM_IDLE,	/* Looking for the 0xFE preamble */
+	ICOM_PREAMBLE,	/* Seen at least one 0xFE */
+	ICOM_BODY,	/* src dst cmd payload, up to 0xFD */
+};
+
+/*
+ * Icom: 0xFE 0xFE src dst cmd payload 0xFD, as understood by
+ * parse_frame_generic() in icf.py.
+ */
+static void dec_icom(struct decoder *dec, const char *name,
+		     const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		switch (dec->state) {
+		case ICOM_IDLE:
+			if (c == 0xFE)
+				dec->state = ICOM_PREAMBLE;
+			else
+				dec->junk++;
+			break;
+		case ICOM_PREAMBLE:
+			if (c == 0xFE)
+				break;
+			dec_junk(dec, name);
+			dec->state = ICOM_BODY;
+			dec->len = 0;
+			/* fall through */
+		case ICOM_BODY:
+			if (c != 0xFD) {
+				if (dec->len < DEC_MAX) {
+					dec->buf[dec->len++] = c;
+				} else {
+					dec->junk += dec->len + 1;
+					dec_reset(dec);
+				}
+				break;
+			}
+
+			if (dec->len >= 3) {
+				icom_show(name, dec->buf, dec->len);
+				dec->frames++;
+			} else {
+				dec->junk += dec->len + 1;
+			}
+			dec_reset(dec);
+			break;
+		}
+	}
+}
+
+enum {
+	BAOFENG_IDLE,
+	BAOFENG_HDR,	/* cmd addr(2) len, big endian */
+	BAOFENG_DATA,	/* len bytes following an 'X' header */
+};
+
+#define BAOFENG_MAX_BLOCK	0x80
+
+static void baofeng_show(const char *name, struct decoder *dec)
+{
+	unsigned int addr = (dec->buf[1] << 8) | dec->buf[2];
+
+	if (dec->buf[0] == 'S')
+		printf("%s: baofeng read 0x%04x len=%u\n", name, addr,
+		       dec->buf[3]);
+	else
+		printf("%s: baofeng data 0x%04x len=%u\n", name, addr,
+		       dec->buf[3]);
+	dec->frames++;
+}
+
+/*
+ * Baofeng: 'S' addr len read requests and 'X' addr len data blocks,
+ * as built by _make_frame() in baofeng_common.py, with single byte
+ * 0x06 acks in between.  Anything else (the ident handshake) is junk.
+ */
+static void dec_baofeng(struct decoder *dec, const char *name,
+			const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		switch (dec->state) {
+		case BAOFENG_IDLE:
+			if ((c == 'S') || (c == 'X')) {
+				dec->buf[0] = c;
+				dec->len = 1;
+				dec->state = BAOFENG_HDR;
+			} else if (c == 0x06) {
+				dec_junk(dec, name);
+				printf("%s: baofeng ack\n", name);
+			} else {
+				dec->junk++;
+			}
+			break;
+		case BAOFENG_HDR:
+			dec->buf[dec->len++] = c;
+			if (dec->len < 4)
+				break;
+
+			if ((dec->buf[3] == 0) ||
+			    (dec->buf[3] > BAOFENG_MAX_BLOCK)) {
+				/* Not a frame after all */
+				dec->junk += dec->len;
+				dec_reset(dec);
+				break;
+			}
+
+			dec_junk(dec, name);
+			if (dec->buf[0] == 'S') {
+				baofeng_show(name, dec);
+				dec_reset(dec);
+			} else {
+				dec->want = 4 + dec->buf[3];
+				dec->state = BAOFENG_DATA;
+			}
+			break;
+		case BAOFENG_DATA:
+			dec->buf[dec->len++] = c;
+			if (dec->len == dec->want) {
+				baofeng_show(name, dec);
+				dec_reset(dec);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Kenwood live mode: ASCII commands and replies, terminated by CR,
+ * such as "ID\r" and "ID TH-D72\r".
+ */
+static void dec_kenwood(struct decoder *dec, const char *name,
+			const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		if ((c == '\r') || (c == '\n')) {
+			if (dec->len == 0)
+				continue;
+			dec_junk(dec, name);
+			printf("%s: kenwood %.*s\n", name, (int)dec->len,
+			       (char *)dec->buf);
+			dec->frames++;
+			dec_reset(dec);
+		} else if ((c < 0x20) || (c > 0x7E) ||
+			   (dec->len == DEC_MAX)) {
+			dec->junk += dec->len + 1;
+			dec_reset(dec);
+		} else {
+			dec->buf[dec->len++] = c;
+		}
+	}
+}
+
+static const struct protocol protocols[] = {
+	{ "icom", dec_icom },
+	{ "baofeng", dec_baofeng },
+	{ "kenwood", dec_kenwood },
+	{ NULL, NULL },
+};
+
+static const struct protocol *find_protocol(const char *name)
+{
+	int i;
+
+	for (i = 0; protocols[i].name; i++)
+		if (STREQ(protocols[i].name, name))
+			return &protocols[i];
+
+	return NULL;
+}
+
+static void decode_rec(struct ss_session *s, const struct dump_rec *rec,
+		       const char *data)
+{
+	const struct path *src = rec->path;
+	struct decoder *dec = src->dec;
+
+	if (!dec)
+		return;
+
+	s->decode->feed(dec, src->name, (const unsigned char *)data, rec->len);
+
+	if (rec->len < rec->count) {
+		/* Only part of the chunk was kept; the rest is lost to us */
+		dec->junk += rec->count - rec->len;
+		dec_reset(dec);
+	}
+
+	/* A quiet line is a good time to report any leftovers */
+	if (rec->timeout)
+		dec_junk(dec, src->name);
+}
+
+static void decode_resync(struct ss_session *s)
+{
+	int i;
+
+	for (i = 0; i < s->npairs; i++) {
+		if (s->pairs[i].A.dec)
+			dec_reset(s->pairs[i].A.dec);
+		if (s->pairs[i].B.dec)
+			dec_reset(s->pairs[i].B.dec);
+	}
+}
+
+static void dump_rec(struct ss_session *s, const struct dump_rec *rec,
+		     const char *data)
+{
+	const struct path *src = rec->path;
+
+	if (rec->timeout && !s->quiescent)
+		printf("Timeout\n");
+	if (!s->quiescent) {
+		if (s->timestamps) {
+			long sec = rec->ts.tv_sec - s->start_ts.tv_sec;
+			long nsec = rec->ts.tv_nsec - s->start_ts.tv_nsec;
+
+			if (nsec < 0) {
+				sec--;
+				nsec += 1000000000;
+			}
+			printf("[%ld.%06ld] ", sec, nsec / 1000);
+		}
+		if (rec->len < rec->count)
+			printf("%s %i (showing %i):\n",
+			       src->name, rec->count, rec->len);
+		else
+			printf("%s %i:\n", src->name, rec->count);
+	}
+	hexdump(s, (char *)data, rec->len, stdout);
+	decode_rec(s, rec, data);
+}
+
+static void *dump_thread(void *arg)
+{
+	struct ss_session *s = arg;
+	struct dump_ring *r = &s->ring;
+	unsigned long reported = 0;
+	uint64_t val;
+
+	while (1) {
+		size_t tail = atomic_load_explicit(&r->tail,
+						   memory_order_relaxed);
+		size_t head = atomic_load_explicit(&r->head,
+						   memory_order_acquire);
+		unsigned long dropped = atomic_load(&r->dropped);
+
+		if (dropped != reported) {
+			printf("*** %lu chunks dropped (%lu total)\n",
+			       dropped - reported, dropped);
+			reported = dropped;
+			decode_resync(s);
+		}
+
+		if (tail == head) {
+			fflush(stdout);
+			if (atomic_load(&r->stop))
+				break;
+
+			/* Re-check after advertising that we will sleep */
+			atomic_store(&r->waiting, true);
+			if (atomic_load(&r->head) == tail &&
+			    !atomic_load(&r->stop))
+				read(r->wake_fd, &val, sizeof(val));
+			atomic_store(&r->waiting, false);
+			continue;
+		}
+
+		while (tail != head) {
+			size_t pos = tail & (r->size - 1);
+			struct dump_rec *rec = (struct dump_rec *)&r->buf[pos];
+
+			if (rec->size == 0) {
+				tail += r->size - pos;
+				continue;
+			}
+
+			dump_rec(s, rec, (char *)(rec + 1));
+			tail += rec->size;
+			atomic_store_explicit(&r->tail, tail,
+					      memory_order_release);
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+static void dump_wake(struct dump_ring *r)
+{
+	uint64_t one = 1;
+
+	if (atomic_exchange(&r->waiting, false))
+		write(r->wake_fd, &one, sizeof(one));
+}
+
+static void dump_push(struct ss_session *s, const struct path *src,
+		      const char *data, int len, int count, bool timeout)
+{
+	struct dump_ring *r = &s->ring;
+	size_t need = REC_ALIGN(sizeof(struct dump_rec) + len);
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t pos = head & (r->size - 1);
+	size_t pad = 0;
+	struct dump_rec *rec;
+
+	if (need > r->size - pos)
+		pad = r->size - pos;
+
+	if (r->size - (head - tail) < need + pad) {
+		atomic_fetch_add(&r->dropped, 1);
+		return;
+	}
+
+	if (pad) {
+		((struct dump_rec *)&r->buf[pos])->size = 0;
+		head += pad;
+		pos = 0;
+	}
+
+	rec = (struct dump_rec *)&r->buf[pos];
+	rec->size = need;
+	rec->len = len;
+	rec->count = count;
+	rec->timeout = timeout;
+	rec->path = src;
+	rec->ts = src->chunk_ts;
+	memcpy(rec + 1, data, len);
+
+	atomic_store_explicit(&r->head, head + need, memory_order_release);
+	dump_wake(r);
+}
+
+static bool dump_start(struct ss_session *s)
+{
+	size_t size = 16 * 1024;
+
+	while (size < s->ring_size)
+		size <<= 1;
+
+	s->ring.size = size;
+	s->ring.buf = malloc(size);
+	if (!s->ring.buf) {
+		perror("malloc");
+		return false;
+	}
+
+	s->ring.wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (s->ring.wake_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &s->start_ts);
+
+	if (pthread_create(&s->ring.thread, NULL, dump_thread, s)) {
+		perror("pthread_create");
+		return false;
+	}
+
+	return true;
+}
+
+static void dump_stop(struct ss_session *s)
+{
+	uint64_t one = 1;
+
+	atomic_store(&s->ring.stop, true);
+	write(s->ring.wake_fd, &one, sizeof(one));
+	pthread_join(s->ring.thread, NULL);
+
+	close(s->ring.wake_fd);
+	free(s->ring.buf);
+	memset(&s->ring, 0, sizeof(s->ring));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Data is timestamped on CLOCK_MONOTONIC_RAW, which NTP never slews,
+ * so the gaps between reads are what the hardware clock measured.
+ * Timers and deadlines stay on now_ns(), as timerfds cannot use the
+ * raw clock.
+ */
+static uint64_t stamp_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_add(struct hist *h, uint64_t val)
+{
+	int b = val ? 64 - __builtin_clzll(val) : 0;
+
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	h->bucket[b]++;
+
+	if ((h->count == 0) || (val < h->min))
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+	h->count++;
+	h->sum += val;
+}
+
+static uint64_t hist_avg(const struct hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+/*
+ * Account for @len bytes read from @src at @ts.  If the peer has spoken
+ * since this path last did, this read is the start of a reply and the
+ * time since the peer's last byte is the turnaround.
+ */
+static void stats_read(struct path *src, uint64_t ts, int len)
+{
+	struct stats *st = &src->stats;
+	const struct stats *peer = &src->peer->stats;
+
+	if (st->last_ns)
+		hist_add(&st->gap, (ts - st->last_ns) / 1000);
+	if (peer->last_ns > st->last_ns)
+		hist_add(&st->turnaround, (ts - peer->last_ns) / 1000);
+
+	st->bytes += len;
+	st->reads++;
+	st->interval_bytes += len;
+	st->last_ns = ts;
+}
+
+static void stats_print(const struct path *path)
+{
+	const struct stats *st = &path->stats;
+
+	printf("%s: %" PRIu64 " B/s (peak %" PRIu64 "), %" PRIu64
+	       " bytes in %" PRIu64 " chunks (avg %" PRIu64 ")",
+	       path->name, st->rate, st->peak_rate, st->bytes,
+	       st->chunk.count, hist_avg(&st->chunk));
+	if (st->turnaround.count)
+		printf(", turnaround avg %.1f max %.1f ms",
+		       hist_avg(&st->turnaround) / 1000.0,
+		       st->turnaround.max / 1000.0);
+	printf("\n");
+}
+
+static void stats_write_hist(FILE *f, const char *name,
+			     const struct hist *h)
+{
+	int last = HIST_BUCKETS - 1;
+	int i;
+
+	while ((last > 0) && (h->bucket[last] == 0))
+		last--;
+
+	fprintf(f, "\"%s\": {\"count\": %" PRIu64 ", \"sum\": %" PRIu64
+		", \"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"log2\": [",
+		name, h->count, h->sum, h->min, h->max);
+	for (i = 0; i <= last; i++)
+		fprintf(f, "%s%" PRIu64, i ? ", " : "", h->bucket[i]);
+	fprintf(f, "]}");
+}
+
+static void stats_write_path(FILE *f, const struct path *path)
+{
+	const struct stats *st = &path->stats;
+
+	fprintf(f, "    {\"name\": \"%s\", \"pair\": %i, \"dir\": \"%c\", "
+		"\"bytes\": %" PRIu64 ", \"reads\": %" PRIu64
+		", \"rate\": %" PRIu64 ", \"peak_rate\": %" PRIu64 ",\n     ",
+		path->name, path->index, path->dir == CAP_DIR_A ? 'A' : 'B',
+		st->bytes, st->reads, st->rate, st->peak_rate);
+	stats_write_hist(f, "chunk_bytes", &st->chunk);
+	fprintf(f, ",\n     ");
+	stats_write_hist(f, "gap_us", &st->gap);
+	fprintf(f, ",\n     ");
+	stats_write_hist(f, "turnaround_us", &st->turnaround);
+	fprintf(f, "}");
+}
+
+/*
+ * The stats file is JSON, replaced atomically so that a reader never
+ * sees a partial update.  Histogram bucket n counts values in
+ * [2^(n-1), 2^n).
+ */
+static void stats_write(struct ss_session *s)
+{
+	char tmp[1100];
+	uint64_t uptime;
+	FILE *f;
+	int i;
+
+	if (!s->stats_file)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", s->stats_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+
+	uptime = stamp_ns() - ((uint64_t)s->start_ts.tv_sec * 1000000000 +
+			       s->start_ts.tv_nsec);
+	fprintf(f, "{\"uptime_ns\": %" PRIu64 ", \"paths\": [\n", uptime);
+	for (i = 0; i < s->npairs; i++) {
+		stats_write_path(f, &s->pairs[i].A);
+		fprintf(f, ",\n");
+		stats_write_path(f, &s->pairs[i].B);
+		fprintf(f, "%s\n", i + 1 < s->npairs ? "," : "");
+	}
+	fprintf(f, "]}\n");
+
+	if (fclose(f) != 0) {
+		perror(tmp);
+		return;
+	}
+	if (rename(tmp, s->stats_file) < 0)
+		perror(s->stats_file);
+}
+
+/* Called once a second from the tick */
+static void stats_tick(struct ss_session *s)
+{
+	int i;
+
+	for (i = 0; i < 2 * s->npairs; i++) {
+		struct pair *pair = &s->pairs[i / 2];
+		struct path *path = i & 1 ? &pair->B : &pair->A;
+		struct stats *st = &path->stats;
+
+		st->rate = st->interval_bytes;
+		st->interval_bytes = 0;
+		if (st->rate > st->peak_rate)
+			st->peak_rate = st->rate;
+	}
+
+	if (++s->stats_ticks <
+	    (s->stats_interval > 0 ? s->stats_interval : 1))
+		return;
+	s->stats_ticks = 0;
+
+	for (i = 0; (s->stats_interval > 0) && (i < s->npairs); i++) {
+		stats_print(&s->pairs[i].A);
+		stats_print(&s->pairs[i].B);
+	}
+	stats_write(s);
+}
+
+static bool open_capture(struct ss_session *s, const char *filename)
+{
+	s->capture.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			  0644);
+	if (s->capture.fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	/* Twice a block, so a block can fill while the last one is held */
+	s->capture.buf = malloc(2 * CAP_BLOCK);
+	if (!s->capture.buf) {
+		perror("malloc");
+		return false;
+	}
+
+	return true;
+}
+
+static void capture_flush(struct ss_session *s)
+{
+	size_t off = 0;
+	int ret;
+
+	while (off < s->capture.len) {
+		ret = write(s->capture.fd, s->capture.buf + off,
+			    s->capture.len - off);
+		if (ret <= 0) {
+			perror("capture");
+			break;
+		}
+		off += ret;
+	}
+
+	s->capture.len = 0;
+}
+
+/*
+ * Reserve room for a record of @len bytes in the capture buffer,
+ * starting a new block (and padding out the current one) if needed.
+ * The caller must keep @len within CAP_BLOCK - headers.
+ */
+static char *capture_reserve(struct ss_session *s, uint64_t ts, int dir,
+			     int pair, size_t len)
+{
+	size_t need = CAP_ALIGN(sizeof(struct cap_rec) + len);
+	size_t in_block = s->capture.pos % CAP_BLOCK;
+	size_t pad = 0;
+	struct cap_rec *rec;
+
+	if ((in_block != 0) && (need > CAP_BLOCK - in_block))
+		pad = CAP_BLOCK - in_block;
+
+	if (s->capture.len + pad + sizeof(struct cap_block) + need >
+	    2 * CAP_BLOCK)
+		capture_flush(s);
+
+	if (pad) {
+		rec = (struct cap_rec *)(s->capture.buf + s->capture.len);
+		memset(rec, 0, pad);
+		rec->len = htole32(pad - sizeof(*rec));
+		rec->dir = CAP_DIR_PAD;
+		s->capture.len += pad;
+		s->capture.pos += pad;
+		in_block = 0;
+	}
+
+	if (in_block == 0) {
+		struct cap_block *blk;
+
+		blk = (struct cap_block *)(s->capture.buf + s->capture.len);
+		memset(blk, 0, sizeof(*blk));
+		memcpy(blk->magic, CAP_MAGIC, sizeof(blk->magic));
+		blk->version = htole16(CAP_VERSION);
+		blk->block_size = htole32(CAP_BLOCK);
+		blk->block_no = htole64(s->capture.pos / CAP_BLOCK);
+		blk->first_ts = htole64(ts);
+		s->capture.len += sizeof(*blk);
+		s->capture.pos += sizeof(*blk);
+	}
+
+	rec = (struct cap_rec *)(s->capture.buf + s->capture.len);
+	memset(rec, 0, need);
+	rec->ts = htole64(ts);
+	rec->len = htole32(len);
+	rec->dir = dir;
+	rec->pair = pair;
+	s->capture.len += need;
+	s->capture.pos += need;
+
+	return (char *)(rec + 1);
+}
+
+#define CAP_MAX_DATA	(CAP_BLOCK - sizeof(struct cap_block) - \
+			 sizeof(struct cap_rec))
+
+static void capture_data(struct ss_session *s, const struct path *src,
+			 uint64_t ts, const char *buf, size_t len)
+{
+	size_t n;
+
+	if (s->capture.fd < 0)
+		return;
+
+	for (; len > 0; buf += n, len -= n) {
+		n = len < CAP_MAX_DATA ? len : CAP_MAX_DATA;
+		memcpy(capture_reserve(s, ts, src->dir, src->index, n), buf, n);
+	}
+}
+
+/*
+ * pcapng output: one interface per path (2 * pair + dir), nanosecond
+ * timestamps, and a user link type since there is no standard one for
+ * raw serial data.  Blocks are built in a buffer and written in
+ * batches, on the tick or when the buffer fills.
+ */
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BOM		0x1A2B3C4D
+#define PCAPNG_BUFSIZE		(256 * 1024)
+#define PCAPNG_PAD(x)		(((x) + 3) & ~((size_t)3))
+
+#define OPT_ENDOFOPT		0
+#define OPT_SHB_USERAPPL	4
+#define OPT_IF_NAME		2
+#define OPT_IF_DESCRIPTION	3
+#define OPT_IF_TSRESOL		9
+
+
+static bool open_pcapng(struct ss_session *s, const char *filename)
+{
+	s->pcapng.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			 0644);
+	if (s->pcapng.fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	s->pcapng.buf = malloc(PCAPNG_BUFSIZE);
+	if (!s->pcapng.buf) {
+		perror("malloc");
+		return false;
+	}
+
+	return true;
+}
+
+static void pcapng_flush(struct ss_session *s)
+{
+	size_t off = 0;
+	int ret;
+
+	while (off < s->pcapng.len) {
+		ret = write(s->pcapng.fd, s->pcapng.buf + off,
+			    s->pcapng.len - off);
+		if (ret <= 0) {
+			perror("pcapng");
+			break;
+		}
+		off += ret;
+	}
+
+	s->pcapng.len = 0;
+}
+
+static char *pcapng_put(struct ss_session *s, const void *data, size_t len)
+{
+	char *p = s->pcapng.buf + s->pcapng.len;
+
+	memset(p, 0, PCAPNG_PAD(len));
+	if (data)
+		memcpy(p, data, len);
+	s->pcapng.len += PCAPNG_PAD(len);
+
+	return p;
+}
+
+static void pcapng_u32(struct ss_session *s, uint32_t val)
+{
+	pcapng_put(s, &val, sizeof(val));
+}
+
+static void pcapng_opt(struct ss_session *s, uint16_t code, const void *data,
+		       uint16_t len)
+{
+	uint16_t hdr[2] = { code, len };
+
+	pcapng_put(s, hdr, sizeof(hdr));
+	if (len)
+		pcapng_put(s, data, len);
+}
+
+/* Start a block; returns its offset so pcapng_end() can fix the length */
+static size_t pcapng_begin(struct ss_session *s, uint32_t type, size_t max)
+{
+	size_t start;
+
+	if (s->pcapng.len + max + 12 > PCAPNG_BUFSIZE)
+		pcapng_flush(s);
+
+	start = s->pcapng.len;
+	pcapng_u32(s, type);
+	pcapng_u32(s, 0);
+
+	return start;
+}
+
+static void pcapng_end(struct ss_session *s, size_t start)
+{
+	uint32_t total = s->pcapng.len - start + 4;
+
+	memcpy(s->pcapng.buf + start + 4, &total, sizeof(total));
+	pcapng_u32(s, total);
+}
+
+static void pcapng_interface(struct ss_session *s, const struct path *path)
+{
+	size_t start = pcapng_begin(s, PCAPNG_IDB, 64 + 2 * sizeof(path->path));
+	uint16_t link[2] = { s->pcapng_linktype, 0 };
+	uint8_t tsresol = 9;
+
+	pcapng_put(s, link, sizeof(link));
+	pcapng_u32(s, 0);	/* snaplen: unlimited */
+	pcapng_opt(s, OPT_IF_NAME, path->name, strlen(path->name));
+	pcapng_opt(s, OPT_IF_DESCRIPTION, path->path, strlen(path->path));
+	pcapng_opt(s, OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	pcapng_opt(s, OPT_ENDOFOPT, NULL, 0);
+	pcapng_end(s, start);
+}
+
+static void pcapng_start(struct ss_session *s)
+{
+	struct timespec mono;
+	struct timespec real;
+	char appl[64];
+	uint16_t major_minor[2] = { 1, 0 };
+	int64_t section_len = -1;
+	size_t start;
+	int i;
+
+	if (s->pcapng.fd < 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &mono);
+	s->pcapng.epoch = ((uint64_t)real.tv_sec - mono.tv_sec) *
+		1000000000ULL + real.tv_nsec - mono.tv_nsec;
+
+	snprintf(appl, sizeof(appl), "serialsniff %s", version);
+
+	start = pcapng_begin(s, PCAPNG_SHB, 128);
+	pcapng_u32(s, PCAPNG_BOM);
+	pcapng_put(s, major_minor, sizeof(major_minor));
+	pcapng_put(s, &section_len, sizeof(section_len));
+	pcapng_opt(s, OPT_SHB_USERAPPL, appl, strlen(appl));
+	pcapng_opt(s, OPT_ENDOFOPT, NULL, 0);
+	pcapng_end(s, start);
+
+	for (i = 0; i < s->npairs; i++) {
+		pcapng_interface(s, &s->pairs[i].A);
+		pcapng_interface(s, &s->pairs[i].B);
+	}
+}
+
+static void pcapng_data(struct ss_session *s, const struct path *src,
+			uint64_t ts, const char *buf, size_t len)
+{
+	size_t start;
+
+	if (s->pcapng.fd < 0)
+		return;
+
+	ts += s->pcapng.epoch;
+
+	start = pcapng_begin(s, PCAPNG_EPB, 20 + PCAPNG_PAD(len));
+	pcapng_u32(s, 2 * src->index + src->dir);
+	pcapng_u32(s, ts >> 32);
+	pcapng_u32(s, ts & 0xFFFFFFFF);
+	pcapng_u32(s, len);
+	pcapng_u32(s, len);
+	pcapng_put(s, buf, len);
+	pcapng_end(s, start);
+}
+
+static void outq_append(struct outq *q, const void *data, size_t len)
+{
+	if (q->len + len > q->size) {
+		q->size = q->len + len + CHUNK_SIZE;
+		q->buf = realloc(q->buf, q->size);
+		if (!q->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	memcpy(q->buf + q->len, data, len);
+	q->len += len;
+}
+
+/*
+ * io_uring backend (--uring), driven through the raw system calls.
+ *
+ * Every path is read with a multishot read into a ring of provided
+ * buffers, so one request stays armed across any number of completions
+ * (on kernels without multishot reads, a single-shot read is re-armed
+ * after each one).  Writes to the peer and appends to the raw logs are
+ * queued as SQEs while events are handled, and everything queued is
+ * submitted with a single io_uring_enter() per trip round the event
+ * loop.  The ring sits in epoll alongside the timers, so the rest of
+ * the loop is unchanged.
+ *
+ * Each path has at most one write and one log append in flight, which
+ * keeps them in order.  Data gathers meanwhile in out (or log_out) and
+ * is swapped in when the request in flight completes.
+ */
+#ifdef HAVE_URING
+
+#define URING_BUFS		64	/* Power of two */
+#define SS_OP_READ_MULTISHOT	49	/* IORING_OP_READ_MULTISHOT (6.7) */
+
+enum {
+	UR_READ,
+	UR_WRITE,
+	UR_LOG,
+	UR_CANCEL,
+};
+
+/* user_data is the path, with the operation in the low bits */
+#define UR_DATA(path, op)	((uint64_t)(uintptr_t)(path) | (op))
+#define UR_PATH(data)		((struct path *)(uintptr_t)((data) & ~7ULL))
+#define UR_OP(data)		((int)((data) & 7))
+
+
+static int uring_enter(struct ss_session *s, unsigned int submit,
+		       unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, s->uring.fd, submit, 0, flags,
+		       NULL, 0);
+}
+
+static void uring_submit(struct ss_session *s)
+{
+	int ret;
+
+	while (s->uring.sq_pending) {
+		ret = uring_enter(s, s->uring.sq_pending, 0);
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN) ||
+			    (errno == EBUSY))
+				continue;
+			perror("io_uring_enter");
+			return;
+		}
+		s->uring.sq_pending -= ret;
+	}
+}
+
+static struct io_uring_sqe *uring_sqe(struct ss_session *s)
+{
+	unsigned int tail = *s->uring.sq_tail;
+	unsigned int index = tail & s->uring.sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(s->uring.sq_head, __ATOMIC_ACQUIRE) >=
+	    s->uring.entries)
+		uring_submit(s);
+
+	sqe = &s->uring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	s->uring.sq_array[index] = index;
+	__atomic_store_n(s->uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	s->uring.sq_pending++;
+
+	return sqe;
+}
+
+static void uring_return_buf(struct ss_session *s, unsigned int bid)
+{
+	unsigned short tail = s->uring.br->tail;
+	struct io_uring_buf *buf = &s->uring.br->bufs[tail & (URING_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(s->uring.bufs + bid * CHUNK_SIZE);
+	buf->len = CHUNK_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&s->uring.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool uring_has_op(struct ss_session *s, int op)
+{
+	struct io_uring_probe *probe;
+	size_t size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+	bool ret = false;
+
+	probe = calloc(1, size);
+	if (!probe)
+		return false;
+
+	if ((syscall(__NR_io_uring_register, s->uring.fd,
+		     IORING_REGISTER_PROBE, probe, 256) == 0) &&
+	    (op <= probe->last_op))
+		ret = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+
+	free(probe);
+
+	return ret;
+}
+
+/* Set up the provided buffer ring that multishot reads take from */
+static bool uring_buffers(struct ss_session *s)
+{
+	struct io_uring_buf_reg reg;
+	size_t size = URING_BUFS * sizeof(struct io_uring_buf);
+	unsigned int i;
+
+	if (!uring_has_op(s, SS_OP_READ_MULTISHOT))
+		return false;
+
+	s->uring.br = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s->uring.br == MAP_FAILED) {
+		s->uring.br = NULL;
+		return false;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)s->uring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+
+	if (syscall(__NR_io_uring_register, s->uring.fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(s->uring.br, size);
+		s->uring.br = NULL;
+		return false;
+	}
+
+	s->uring.bufs = malloc(URING_BUFS * CHUNK_SIZE);
+	if (!s->uring.bufs) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < URING_BUFS; i++)
+		uring_return_buf(s, i);
+
+	return true;
+}
+
+static void *uring_map(struct ss_session *s, size_t size, off_t offset)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, s->uring.fd, offset);
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return map;
+}
+
+static bool uring_start(struct ss_session *s, int epfd)
+{
+	struct io_uring_params p;
+	struct epoll_event ev;
+	char *sq;
+	char *cq;
+
+	memset(&p, 0, sizeof(p));
+	s->uring.fd = syscall(__NR_io_uring_setup, s->uring_entries, &p);
+	if (s->uring.fd < 0) {
+		perror("io_uring_setup");
+		return false;
+	}
+
+	s->uring.sq_ring_size = p.sq_off.array +
+		p.sq_entries * sizeof(unsigned);
+	s->uring.cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (s->uring.cq_ring_size > s->uring.sq_ring_size)
+			s->uring.sq_ring_size = s->uring.cq_ring_size;
+		s->uring.cq_ring_size = s->uring.sq_ring_size;
+	}
+	s->uring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	s->uring.sq_ring = uring_map(s, s->uring.sq_ring_size,
+				     IORING_OFF_SQ_RING);
+	if (!s->uring.sq_ring)
+		return false;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		s->uring.cq_ring = s->uring.sq_ring;
+	else
+		s->uring.cq_ring = uring_map(s, s->uring.cq_ring_size,
+					  IORING_OFF_CQ_RING);
+	s->uring.sqes = uring_map(s, s->uring.sqes_size, IORING_OFF_SQES);
+	if (!s->uring.cq_ring || !s->uring.sqes)
+		return false;
+
+	sq = s->uring.sq_ring;
+	cq = s->uring.cq_ring;
+	s->uring.entries = p.sq_entries;
+	s->uring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	s->uring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	s->uring.sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	s->uring.sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	s->uring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	s->uring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	s->uring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	s->uring.cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	s->uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	s->uring.multishot = uring_buffers(s);
+	if (!s->uring.multishot && !s->quiescent)
+		printf("io_uring: no multishot reads, re-arming each read\n");
+
+	s->uring.src.type = SRC_URING;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->uring.src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->uring.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+static void uring_stop(struct ss_session *s)
+{
+	if (s->uring.fd < 0)
+		return;
+
+	close(s->uring.fd);
+	if (s->uring.sqes)
+		munmap(s->uring.sqes, s->uring.sqes_size);
+	if (s->uring.cq_ring && (s->uring.cq_ring != s->uring.sq_ring))
+		munmap(s->uring.cq_ring, s->uring.cq_ring_size);
+	if (s->uring.sq_ring)
+		munmap(s->uring.sq_ring, s->uring.sq_ring_size);
+	if (s->uring.br)
+		munmap(s->uring.br, URING_BUFS * sizeof(struct io_uring_buf));
+	free(s->uring.bufs);
+
+	memset(&s->uring, 0, sizeof(s->uring));
+	s->uring.fd = -1;
+}
+
+static void uring_arm_read(struct ss_session *s, struct path *path)
+{
+	struct io_uring_sqe *sqe = uring_sqe(s);
+
+	path->read_armed = true;
+	sqe->fd = path->fd;
+	sqe->user_data = UR_DATA(path, UR_READ);
+
+	if (s->uring.multishot) {
+		sqe->opcode = SS_OP_READ_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		return;
+	}
+
+	if (!path->ubuf) {
+		path->ubuf = malloc(CHUNK_SIZE);
+		if (!path->ubuf) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->addr = (uint64_t)(uintptr_t)path->ubuf;
+	sqe->len = CHUNK_SIZE;
+	sqe->off = -1;
+}
+
+static void uring_cancel_read(struct ss_session *s, struct path *path)
+{
+	struct io_uring_sqe *sqe = uring_sqe(s);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = UR_DATA(path, UR_READ);
+	sqe->user_data = UR_DATA(path, UR_CANCEL);
+}
+
+static void uring_write(struct ss_session *s, int fd, struct outq *q,
+			uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(s);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = -1;		/* At the file position, for the logs */
+	sqe->addr = (uint64_t)(uintptr_t)q->buf;
+	sqe->len = q->len;
+	sqe->user_data = data;
+}
+
+/* Start writing whatever has gathered for @dst, unless a write is out */
+static void uring_send_next(struct ss_session *s, struct path *dst)
+{
+	struct outq q;
+
+	if (dst->sending.len || !dst->out.len)
+		return;
+
+	q = dst->sending;
+	dst->sending = dst->out;
+	dst->out = q;
+	uring_write(s, dst->fd, &dst->sending, UR_DATA(dst, UR_WRITE));
+}
+
+static void uring_send(struct ss_session *s, struct path *dst, const char *buf,
+		       int count)
+{
+	outq_append(&dst->out, buf, count);
+	uring_send_next(s, dst);
+}
+
+static void uring_log_next(struct ss_session *s, struct path *path)
+{
+	struct outq q;
+
+	if (path->logging.len || !path->log_out.len)
+		return;
+
+	q = path->logging;
+	path->logging = path->log_out;
+	path->log_out = q;
+	uring_write(s, path->rawlog_fd, &path->logging, UR_DATA(path, UR_LOG));
+}
+
+static void uring_log(struct ss_session *s, struct path *path, const char *buf,
+		      int count)
+{
+	outq_append(&path->log_out, buf, count);
+	uring_log_next(s, path);
+}
+
+#else
+
+static bool uring_start(struct ss_session *s, int epfd)
+{
+	return false;
+}
+
+static void uring_stop(struct ss_session *s)
+{
+}
+
+static void uring_submit(struct ss_session *s)
+{
+}
+
+static void uring_arm_read(struct ss_session *s, struct path *path)
+{
+}
+
+static void uring_cancel_read(struct ss_session *s, struct path *path)
+{
+}
+
+static void uring_send(struct ss_session *s, struct path *dst, const char *buf,
+		       int count)
+{
+}
+
+static void uring_log(struct ss_session *s, struct path *path, const char *buf,
+		      int count)
+{
+}
+
+#endif
+
+/*
+ * Observers are TCP clients that get a read-only mirror of every pair.
+ * Each one is sent the capture record stream (a struct cap_rec header
+ * followed by the data, padded to CAP_ALIGN) through its own bounded
+ * queue; records that do not fit are dropped for that observer alone,
+ * so a slow observer never holds up forwarding.
+ */
+
+/*
+ * Parse [ADDR:]PORT (or an empty string) into @sin, defaulting to all
+ * addresses and @port.
+ */
+static bool parse_addr(const char *spec, struct sockaddr_in *sin, int port)
+{
+	const char *colon = spec ? strrchr(spec, ':') : NULL;
+	char host[64];
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = INADDR_ANY;
+	sin->sin_port = htons(port);
+
+	if (!spec || !*spec)
+		return true;
+
+	if (colon) {
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+		if (inet_pton(AF_INET, host, &sin->sin_addr) != 1) {
+			fprintf(stderr, "Invalid address '%s'\n", host);
+			return false;
+		}
+		spec = colon + 1;
+	}
+
+	port = atoi(spec);
+	if ((port <= 0) || (port > 65535)) {
+		fprintf(stderr, "Invalid port '%s'\n", spec);
+		return false;
+	}
+	sin->sin_port = htons(port);
+
+	return true;
+}
+
+static int listen_on(const struct sockaddr_in *sin, int backlog)
+{
+	int optval = 1;
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+	if (bind(lfd, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		perror("bind");
+		close(lfd);
+		return -1;
+	}
+
+	if (listen(lfd, backlog) < 0) {
+		perror("listen");
+		close(lfd);
+		return -1;
+	}
+
+	return lfd;
+}
+
+static bool open_observe(struct ss_session *s, const char *spec)
+{
+	struct sockaddr_in sin;
+
+	if (!parse_addr(spec, &sin, 2001))
+		return false;
+
+	s->observe.fd = listen_on(&sin, 16);
+	if (s->observe.fd < 0)
+		return false;
+
+	fcntl(s->observe.fd, F_SETFL, O_NONBLOCK);
+	printf("Observers may connect to %s:%i\n",
+	       inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+
+	return true;
+}
+
+static void observer_events(struct ss_session *s, struct observer *obs)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (obs->q.len ? EPOLLOUT : 0);
+	ev.data.ptr = &obs->src;
+	epoll_ctl(s->observe.epfd, EPOLL_CTL_MOD, obs->fd, &ev);
+}
+
+static void observer_close(struct ss_session *s, struct observer *obs)
+{
+	struct observer **pp;
+
+	for (pp = &s->observe.clients; *pp; pp = &(*pp)->next) {
+		if (*pp == obs) {
+			*pp = obs->next;
+			break;
+		}
+	}
+
+	printf("Observer %s disconnected (%lu records dropped)\n",
+	       obs->name, obs->dropped);
+	epoll_ctl(s->observe.epfd, EPOLL_CTL_DEL, obs->fd, NULL);
+	close(obs->fd);
+	free(obs->q.buf);
+	free(obs);
+}
+
+static bool observe_start(struct ss_session *s, int epfd)
+{
+	struct epoll_event ev;
+
+	if (s->observe.fd < 0)
+		return true;
+
+	s->observe.epfd = epfd;
+	s->observe.src.type = SRC_LISTEN;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->observe.src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->observe.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+static void handle_listen(struct ss_session *s)
+{
+	struct sockaddr_in cli;
+	socklen_t cli_len = sizeof(cli);
+	struct epoll_event ev;
+	struct observer *obs;
+	int fd;
+
+	while ((fd = accept4(s->observe.fd, (struct sockaddr *)&cli, &cli_len,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		obs = calloc(1, sizeof(*obs));
+		if (!obs) {
+			close(fd);
+			continue;
+		}
+
+		obs->fd = fd;
+		obs->src.type = SRC_OBSERVER;
+		obs->src.priv = obs;
+		snprintf(obs->name, sizeof(obs->name), "%s:%i",
+			 inet_ntoa(cli.sin_addr), ntohs(cli.sin_port));
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = &obs->src;
+		if (epoll_ctl(s->observe.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(fd);
+			free(obs);
+			continue;
+		}
+
+		obs->next = s->observe.clients;
+		s->observe.clients = obs;
+		printf("Observer %s connected\n", obs->name);
+		cli_len = sizeof(cli);
+	}
+}
+
+static void handle_observer(struct ss_session *s, struct observer *obs,
+			    uint32_t events)
+{
+	char buf[256];
+	int ret;
+
+	if (events & EPOLLOUT) {
+		ret = send(obs->fd, obs->q.buf, obs->q.len, MSG_NOSIGNAL);
+		if (ret > 0) {
+			memmove(obs->q.buf, obs->q.buf + ret, obs->q.len - ret);
+			obs->q.len -= ret;
+			if (obs->q.len == 0)
+				observer_events(s, obs);
+		}
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		/* Observers are read-only; discard what they send */
+		ret = read(obs->fd, buf, sizeof(buf));
+		if ((ret == 0) || ((ret < 0) && (errno != EAGAIN)))
+			observer_close(s, obs);
+	}
+}
+
+static void observe_data(struct ss_session *s, const struct path *src,
+			 uint64_t ts, const char *buf, size_t len)
+{
+	struct observer *obs;
+	struct cap_rec rec;
+	static const char pad[16];
+	size_t padlen = CAP_ALIGN(sizeof(rec) + len) - sizeof(rec) - len;
+	size_t total = sizeof(rec) + len + padlen;
+
+	if (!s->observe.clients)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = htole64(ts);
+	rec.len = htole32(len);
+	rec.dir = src->dir;
+	rec.pair = src->index;
+
+	for (obs = s->observe.clients; obs; obs = obs->next) {
+		struct iovec iov[3] = {
+			{ &rec, sizeof(rec) },
+			{ (void *)buf, len },
+			{ (void *)pad, padlen },
+		};
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+		ssize_t sent = 0;
+		size_t skip;
+		int i;
+
+		if (obs->q.len == 0) {
+			/* A vanished observer must not SIGPIPE the proxy */
+			sent = sendmsg(obs->fd, &msg, MSG_NOSIGNAL);
+			if (sent < 0)
+				sent = 0;
+			if ((size_t)sent == total)
+				continue;
+		}
+
+		if (obs->q.len + total - sent > s->observe.qmax) {
+			obs->dropped++;
+			continue;
+		}
+
+		/* Queue whatever part of the record was not sent */
+		skip = sent;
+		for (i = 0; i < 3; i++) {
+			if (skip >= iov[i].iov_len) {
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			outq_append(&obs->q, (char *)iov[i].iov_base + skip,
+				    iov[i].iov_len - skip);
+			skip = 0;
+		}
+
+		if (obs->q.len == total - sent)
+			observer_events(s, obs);
+	}
+}
+
+/*
+ * Trigger filters.  When any are given, the capture and pcapng
+ * recorders only see the traffic around a trigger: reads are held in a
+ * circular buffer for the pre-trigger window and discarded as they age
+ * out, unless a trigger fires, in which case the held reads and
+ * everything up to the end of the post-trigger window are committed.
+ *
+ * A trigger is a comma separated list of conditions, all of which must
+ * hold for a single read:
+ *
+ *   dir=A|B		the read came from that side
+ *   pattern=HEX	the stream contains these bytes, ?? matches any
+ *			byte (e.g. FEFE????E4 for Icom clone data)
+ *   len=MIN[-MAX]	the read is this many bytes long
+ *
+ * Patterns are matched incrementally: each path keeps the last few
+ * bytes it has seen, so a pattern split across reads is still found.
+ */
+
+static bool parse_trigger(struct ss_session *s, const char *spec)
+{
+	struct trigger *t = calloc(1, sizeof(*t));
+	struct trigger **tp;
+	char *copy = strdup(spec);
+	char *save = NULL;
+	char *term;
+
+	if (!t || !copy) {
+		perror("malloc");
+		return false;
+	}
+
+	t->spec = strdup(spec);
+	t->dir = -1;
+	t->max_len = SIZE_MAX;
+
+	for (term = strtok_r(copy, ",", &save); term;
+	     term = strtok_r(NULL, ",", &save)) {
+		if (STREQ(term, "dir=A")) {
+			t->dir = CAP_DIR_A;
+		} else if (STREQ(term, "dir=B")) {
+			t->dir = CAP_DIR_B;
+		} else if (strncmp(term, "len=", 4) == 0) {
+			char *dash = strchr(term, '-');
+
+			t->min_len = strtoul(term + 4, NULL, 0);
+			t->max_len = dash ? strtoul(dash + 1, NULL, 0) :
+					    t->min_len;
+		} else if (strncmp(term, "pattern=", 8) == 0) {
+			const char *hex = term + 8;
+
+			while (hex[0] && hex[1] && (t->patlen < PATTERN_MAX)) {
+				int hi = unhex(hex[0]);
+				int lo = unhex(hex[1]);
+
+				if ((hex[0] == '?') && (hex[1] == '?')) {
+					t->mask[t->patlen++] = 0;
+				} else if ((hi < 0) || (lo < 0)) {
+					break;
+				} else {
+					t->pat[t->patlen] = (hi << 4) | lo;
+					t->mask[t->patlen++] = 0xFF;
+				}
+				hex += 2;
+			}
+			if (*hex || (t->patlen == 0)) {
+				fprintf(stderr, "Invalid pattern '%s'\n",
+					term + 8);
+				return false;
+			}
+		} else {
+			fprintf(stderr, "Unknown trigger condition '%s'\n",
+				term);
+			return false;
+		}
+	}
+	free(copy);
+
+	for (tp = &s->filter.triggers; *tp; tp = &(*tp)->next)
+		;
+	*tp = t;
+
+	return true;
+}
+
+static bool filter_start(struct ss_session *s)
+{
+	struct trigger *t;
+	size_t size = 16 * 1024;
+
+	if (!s->filter.triggers)
+		return true;
+
+	for (t = s->filter.triggers; t; t = t->next) {
+		free(t->tails);
+		t->tails = calloc(2 * s->npairs, sizeof(*t->tails));
+		if (!t->tails) {
+			perror("calloc");
+			return false;
+		}
+	}
+
+	while (size < s->filter.size)
+		size <<= 1;
+	s->filter.size = size;
+	free(s->filter.buf);
+	s->filter.buf = malloc(size);
+	if (!s->filter.buf) {
+		perror("malloc");
+		return false;
+	}
+
+	return true;
+}
+
+static bool pattern_match(struct trigger *t, const struct path *src,
+			  const unsigned char *buf, size_t len)
+{
+	struct pattern_tail *tail = &t->tails[2 * src->index + src->dir];
+	unsigned char scan[PATTERN_MAX + CHUNK_SIZE];
+	size_t n = tail->len;
+	size_t keep;
+	size_t i;
+	size_t j;
+	bool found = false;
+
+	/* Only the previous patlen-1 bytes plus this read are examined */
+	if (len > CHUNK_SIZE) {
+		buf += len - CHUNK_SIZE;
+		len = CHUNK_SIZE;
+	}
+	memcpy(scan, tail->buf, n);
+	memcpy(scan + n, buf, len);
+	n += len;
+
+	for (i = 0; !found && (i + t->patlen <= n); i++) {
+		for (j = 0; j < t->patlen; j++)
+			if ((scan[i + j] & t->mask[j]) != t->pat[j])
+				break;
+		found = (j == t->patlen);
+	}
+
+	keep = n < t->patlen - 1 ? n : t->patlen - 1;
+	memcpy(tail->buf, scan + n - keep, keep);
+	tail->len = keep;
+
+	return found;
+}
+
+static struct trigger *trigger_check(struct ss_session *s,
+				     const struct path *src, const char *buf,
+				     size_t len)
+{
+	struct trigger *hit = NULL;
+	struct trigger *t;
+
+	/* Every pattern must see every read to keep its tail current */
+	for (t = s->filter.triggers; t; t = t->next) {
+		bool match = true;
+
+		if ((t->dir >= 0) && (t->dir != src->dir))
+			match = false;
+		if ((len < t->min_len) || (len > t->max_len))
+			match = false;
+		if (t->patlen &&
+		    !pattern_match(t, src, (const unsigned char *)buf, len))
+			match = false;
+
+		if (match && !hit)
+			hit = t;
+	}
+
+	return hit;
+}
+
+static void commit_data(struct ss_session *s, const struct path *src,
+			uint64_t ts, const char *buf, size_t len)
+{
+	capture_data(s, src, ts, buf, len);
+	pcapng_data(s, src, ts, buf, len);
+	s->filter.committed += len;
+}
+
+/* Discard the oldest held read */
+static void filter_drop(struct ss_session *s)
+{
+	size_t pos = s->filter.tail & (s->filter.size - 1);
+	struct held_rec *rec = (struct held_rec *)&s->filter.buf[pos];
+
+	if (rec->size == 0) {
+		s->filter.tail += s->filter.size - pos;
+		return;
+	}
+
+	s->filter.discarded += rec->len;
+	s->filter.tail += rec->size;
+}
+
+static void filter_hold(struct ss_session *s, const struct path *src,
+			uint64_t ts, const char *buf, size_t len)
+{
+	size_t need = REC_ALIGN(sizeof(struct held_rec) + len);
+	size_t pos;
+	size_t pad;
+	struct held_rec *rec;
+
+	/* Age out whatever has fallen out of the pre-trigger window */
+	while (s->filter.tail != s->filter.head) {
+		pos = s->filter.tail & (s->filter.size - 1);
+		rec = (struct held_rec *)&s->filter.buf[pos];
+		if (rec->size && (rec->ts + s->filter.pre_ns >= ts))
+			break;
+		filter_drop(s);
+	}
+
+	if (need > s->filter.size / 2) {
+		s->filter.discarded += len;
+		return;
+	}
+
+	pos = s->filter.head & (s->filter.size - 1);
+	pad = need > s->filter.size - pos ? s->filter.size - pos : 0;
+	while (s->filter.size - (s->filter.head - s->filter.tail) < need + pad)
+		filter_drop(s);
+
+	if (pad) {
+		((struct held_rec *)&s->filter.buf[pos])->size = 0;
+		s->filter.head += pad;
+		pos = 0;
+	}
+
+	rec = (struct held_rec *)&s->filter.buf[pos];
+	rec->size = need;
+	rec->len = len;
+	rec->ts = ts;
+	rec->src = src;
+	memcpy(rec + 1, buf, len);
+	s->filter.head += need;
+}
+
+/* Commit everything held, oldest first */
+static void filter_release(struct ss_session *s)
+{
+	while (s->filter.tail != s->filter.head) {
+		size_t pos = s->filter.tail & (s->filter.size - 1);
+		struct held_rec *rec = (struct held_rec *)&s->filter.buf[pos];
+
+		if (rec->size == 0) {
+			s->filter.tail += s->filter.size - pos;
+			continue;
+		}
+
+		commit_data(s, rec->src, rec->ts, (char *)(rec + 1), rec->len);
+		s->filter.tail += rec->size;
+	}
+}
+
+static void filter_data(struct ss_session *s, const struct path *src,
+			uint64_t ts, const char *buf, size_t len)
+{
+	struct trigger *t = trigger_check(s, src, buf, len);
+
+	if (t) {
+		if (ts > s->filter.post_until)
+			printf("*** Trigger '%s' fired on %s\n", t->spec,
+			       src->name);
+		s->filter.fired++;
+		filter_release(s);
+		s->filter.post_until = ts + s->filter.post_ns;
+	}
+
+	if (ts <= s->filter.post_until)
+		commit_data(s, src, ts, buf, len);
+	else
+		filter_hold(s, src, ts, buf, len);
+}
+
+static void filter_report(struct ss_session *s)
+{
+	if (!s->filter.triggers)
+		return;
+
+	printf("Triggers fired %lu times: %" PRIu64 " bytes recorded, %"
+	       PRIu64 " discarded\n",
+	       s->filter.fired, s->filter.committed, s->filter.discarded);
+}
+
+static void compare_data(struct ss_session *s, const struct path *src,
+			 uint64_t ts, const char *buf, size_t len);
+
+/* Hand a chunk of data read from @src to every active recorder */
+static void record_data(struct ss_session *s, const struct path *src,
+			uint64_t ts, const char *buf, size_t len)
+{
+	if (s->filter.triggers) {
+		filter_data(s, src, ts, buf, len);
+	} else {
+		capture_data(s, src, ts, buf, len);
+		pcapng_data(s, src, ts, buf, len);
+	}
+	observe_data(s, src, ts, buf, len);
+	compare_data(s, src, ts, buf, len);
+}
+
+static void record_flush(struct ss_session *s)
+{
+	if (s->capture.len > 0)
+		capture_flush(s);
+	if (s->pcapng.len > 0)
+		pcapng_flush(s);
+}
+
+/* In splice mode the recorders get a copy from their own tee()d pipe */
+static void record_pipe(struct ss_session *s, struct path *src, uint64_t ts,
+			int len)
+{
+	char buf[CHUNK_SIZE];
+	int off = 0;
+	int ret;
+
+	if ((s->capture.fd < 0) && (s->pcapng.fd < 0) && !s->observe.clients &&
+	    !s->compare_file)
+		return;
+
+	ret = tee(src->fwd_pipe[0], src->cap_pipe[1], len, 0);
+	while (off < ret) {
+		int n = read(src->cap_pipe[0], buf + off, ret - off);
+
+		if (n <= 0)
+			break;
+		off += n;
+	}
+
+	if (off > 0)
+		record_data(s, src, ts, buf, off);
+}
+
+static void capture_name(char *name, size_t size, int dir, int pair)
+{
+	if (pair == 0)
+		snprintf(name, size, "%c", dir == CAP_DIR_A ? 'A' : 'B');
+	else
+		snprintf(name, size, "%c%i", dir == CAP_DIR_A ? 'A' : 'B',
+			 pair);
+}
+
+/*
+ * Sequential reader over the records of a capture file.  The file is
+ * mapped rather than read, and pages that have been walked past are
+ * dropped as the reader goes, so even a multi-gigabyte capture is
+ * streamed in one pass in constant memory.  cap_seek() positions the
+ * reader at the block that holds the first record at or after a given
+ * time.
+ */
+#define CAP_RELEASE	(16 * 1024 * 1024)
+
+static bool cap_block_ts(struct cap_reader *r, uint64_t block, uint64_t *ts)
+{
+	const struct cap_block *blk;
+
+	if (block * CAP_BLOCK + sizeof(*blk) > r->size)
+		return false;
+
+	blk = (const struct cap_block *)(r->map + block * CAP_BLOCK);
+	if (memcmp(blk->magic, CAP_MAGIC, sizeof(blk->magic)) != 0)
+		return false;
+
+	*ts = le64toh(blk->first_ts);
+
+	return true;
+}
+
+static bool cap_open(struct cap_reader *r, const char *filename)
+{
+	struct stat st;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror(filename);
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: not a capture file\n", filename);
+		close(fd);
+		return false;
+	}
+
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		perror(filename);
+		return false;
+	}
+	madvise((void *)r->map, r->size, MADV_SEQUENTIAL);
+
+	r->nblocks = (r->size + CAP_BLOCK - 1) / CAP_BLOCK;
+
+	if (!cap_block_ts(r, 0, &r->base)) {
+		fprintf(stderr, "%s: not a capture file\n", filename);
+		munmap((void *)r->map, r->size);
+		return false;
+	}
+
+	return true;
+}
+
+static void cap_close(struct cap_reader *r)
+{
+	munmap((void *)r->map, r->size);
+}
+
+static void cap_seek(struct cap_reader *r, uint64_t ts)
+{
+	uint64_t lo = 0;
+	uint64_t hi = r->nblocks - 1;
+	uint64_t first;
+
+	while (lo < hi) {
+		uint64_t mid = (lo + hi + 1) / 2;
+
+		if (cap_block_ts(r, mid, &first) && (first <= ts))
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	r->block = lo;
+	r->released = lo * CAP_BLOCK;
+	r->len = 0;
+	r->off = 0;
+}
+
+/* Drop the pages of blocks that have been read from the mapping */
+static void cap_release(struct cap_reader *r)
+{
+	uint64_t done = r->block * CAP_BLOCK;
+
+	if (done - r->released < CAP_RELEASE)
+		return;
+
+	madvise((void *)(r->map + r->released), done - r->released,
+		MADV_DONTNEED);
+	r->released = done;
+}
+
+/* Return the next data record (followed by its data), or NULL at EOF */
+static const struct cap_rec *cap_next(struct cap_reader *r)
+{
+	while (1) {
+		const struct cap_rec *rec;
+		uint32_t len;
+
+		if (r->off + sizeof(*rec) > r->len) {
+			if (r->block >= r->nblocks)
+				return NULL;
+
+			cap_release(r);
+			r->buf = r->map + r->block * CAP_BLOCK;
+			r->len = r->size - r->block * CAP_BLOCK;
+			if (r->len > CAP_BLOCK)
+				r->len = CAP_BLOCK;
+			r->block++;
+			if ((r->len < sizeof(struct cap_block)) ||
+			    memcmp(r->buf, CAP_MAGIC, strlen(CAP_MAGIC))) {
+				r->block = r->nblocks;
+				r->len = 0;
+				return NULL;
+			}
+			r->off = sizeof(struct cap_block);
+			continue;
+		}
+
+		rec = (const struct cap_rec *)(r->buf + r->off);
+		len = le32toh(rec->len);
+		if ((rec->dir == CAP_DIR_PAD) ||
+		    (r->off + sizeof(*rec) + len > r->len)) {
+			r->off = r->len;
+			continue;
+		}
+
+		r->off += CAP_ALIGN(sizeof(*rec) + len);
+
+		return rec;
+	}
+}
+
+/*
+ * Print the records of a capture file between read_from and read_to
+ * seconds (relative to the start of the capture).  The starting block
+ * is found by binary search on the block headers, so only the blocks
+ * in the requested window are read.
+ */
+static int read_capture(struct ss_session *s, const char *filename)
+{
+	struct cap_reader r;
+	const struct cap_rec *rec;
+	uint64_t from;
+	uint64_t to;
+
+	if (!cap_open(&r, filename))
+		return 1;
+
+	from = r.base + (uint64_t)(s->read_from * 1e9);
+	to = s->read_to < 0 ? UINT64_MAX :
+		r.base + (uint64_t)(s->read_to * 1e9);
+
+	cap_seek(&r, from);
+
+	while ((rec = cap_next(&r))) {
+		uint64_t ts = le64toh(rec->ts);
+		uint32_t len = le32toh(rec->len);
+		char name[16];
+
+		if (ts > to)
+			break;
+		if (ts < from)
+			continue;
+
+		capture_name(name, sizeof(name), rec->dir, rec->pair);
+		if (!s->quiescent)
+			printf("[%.6f] %s %u:\n", (ts - r.base) / 1e9, name, len);
+		hexdump(s, (char *)(rec + 1), len, stdout);
+	}
+
+	cap_close(&r);
+
+	return 0;
+}
+
+/*
+ * Offline analysis: split a capture into clone sessions and time their
+ * phases.  A session is the traffic on one pair between silences of
+ * more than --session-gap.  Within it, each exchange (what A sent
+ * followed by what B answered) is classified without knowing the
+ * protocol.  Bulk data (at least BULK_MIN bytes, and more than came the
+ * other way) is an upload when A sent it and a block read when B did.
+ * An exchange of nothing but ACKs is an ack.  Anything else is ident
+ * before the first bulk transfer and "other" after it.  Silences
+ * longer than --idle-gap are counted as idle time rather than against a
+ * phase.
+ *
+ * Only the current exchange of each pair is kept, so memory does not
+ * grow with the capture, and sessions are reported as they end.
+ */
+#define BULK_MIN	16
+#define ASCII_ACK	0x06
+
+enum {
+	PHASE_IDENT,
+	PHASE_READ,
+	PHASE_ACK,
+	PHASE_UPLOAD,
+	PHASE_OTHER,
+	PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	"ident", "read", "ack", "upload", "other",
+};
+
+struct phase_stats {
+	unsigned long count;
+	uint64_t ns;
+	uint64_t bytes;
+};
+
+struct clone_session {
+	bool active;
+	uint64_t start;
+	uint64_t last;
+	uint64_t bytes[2];
+	bool bulk_seen;
+
+	/* The exchange in progress */
+	uint64_t ex_start;
+	uint64_t ex_idle;
+	uint64_t ex_bytes[2];
+	bool ex_only_ack;
+
+	struct phase_stats phase[PHASE_MAX];
+	unsigned long idle_count;
+	uint64_t idle_ns;
+	uint64_t idle_max;
+};
+
+static void exchange_end(struct clone_session *cs, uint64_t end)
+{
+	uint64_t a = cs->ex_bytes[CAP_DIR_A];
+	uint64_t b = cs->ex_bytes[CAP_DIR_B];
+	struct phase_stats *ps;
+	int phase;
+
+	if ((a >= BULK_MIN) && (a > b))
+		phase = PHASE_UPLOAD;
+	else if ((b >= BULK_MIN) && (b > a))
+		phase = PHASE_READ;
+	else if (cs->ex_only_ack)
+		phase = PHASE_ACK;
+	else
+		phase = cs->bulk_seen ? PHASE_OTHER : PHASE_IDENT;
+
+	if ((phase == PHASE_UPLOAD) || (phase == PHASE_READ))
+		cs->bulk_seen = true;
+
+	ps = &cs->phase[phase];
+	ps->count++;
+	ps->ns += end - cs->ex_start - cs->ex_idle;
+	ps->bytes += a + b;
+}
+
+static void exchange_begin(struct clone_session *cs, uint64_t ts)
+{
+	cs->ex_start = ts;
+	cs->ex_idle = 0;
+	cs->ex_bytes[CAP_DIR_A] = cs->ex_bytes[CAP_DIR_B] = 0;
+	cs->ex_only_ack = true;
+}
+
+static void session_report(struct clone_session *cs, int pair, int number,
+			   uint64_t base)
+{
+	char a[16];
+	char b[16];
+	int i;
+
+	exchange_end(cs, cs->last);
+	cs->active = false;
+
+	capture_name(a, sizeof(a), CAP_DIR_A, pair);
+	capture_name(b, sizeof(b), CAP_DIR_B, pair);
+
+	printf("Session %i (%s<->%s) at %.6f: %.6fs, %s %" PRIu64
+	       " bytes, %s %" PRIu64 " bytes\n",
+	       number, a, b, (cs->start - base) / 1e9,
+	       (cs->last - cs->start) / 1e9,
+	       a, cs->bytes[CAP_DIR_A], b, cs->bytes[CAP_DIR_B]);
+
+	for (i = 0; i < PHASE_MAX; i++) {
+		const struct phase_stats *ps = &cs->phase[i];
+
+		if (!ps->count)
+			continue;
+		printf("  %-8s %8lu exchanges %12.6fs %10" PRIu64 " bytes\n",
+		       phase_names[i], ps->count, ps->ns / 1e9, ps->bytes);
+	}
+	if (cs->idle_count)
+		printf("  %-8s %8lu gaps      %12.6fs (longest %.6fs)\n",
+		       "idle", cs->idle_count, cs->idle_ns / 1e9,
+		       cs->idle_max / 1e9);
+}
+
+static int analyze_capture(struct ss_session *s, const char *filename)
+{
+	struct clone_session *sessions;
+	const struct cap_rec *rec;
+	struct cap_reader r;
+	uint64_t from;
+	uint64_t to;
+	uint64_t last = 0;
+	int number = 0;
+	int i;
+
+	if (!cap_open(&r, filename))
+		return 1;
+
+	/* The pair field is a byte, so this covers every pair */
+	sessions = calloc(256, sizeof(*sessions));
+	if (!sessions) {
+		perror("calloc");
+		cap_close(&r);
+		return 1;
+	}
+
+	from = r.base + (uint64_t)(s->read_from * 1e9);
+	to = s->read_to < 0 ? UINT64_MAX :
+		r.base + (uint64_t)(s->read_to * 1e9);
+
+	cap_seek(&r, from);
+
+	while ((rec = cap_next(&r))) {
+		struct clone_session *cs = &sessions[rec->pair];
+		const unsigned char *data = (const unsigned char *)(rec + 1);
+		uint64_t ts = le64toh(rec->ts);
+		uint32_t len = le32toh(rec->len);
+		int dir = rec->dir == CAP_DIR_A ? CAP_DIR_A : CAP_DIR_B;
+		uint32_t j;
+
+		if (ts > to)
+			break;
+		if (ts < from)
+			continue;
+		last = ts;
+
+		if (cs->active && (ts - cs->last > s->session_gap_ns))
+			session_report(cs, rec->pair, ++number, r.base);
+
+		if (!cs->active) {
+			memset(cs, 0, sizeof(*cs));
+			cs->active = true;
+			cs->start = cs->last = ts;
+			exchange_begin(cs, ts);
+		} else if (ts - cs->last > s->idle_gap_ns) {
+			uint64_t gap = ts - cs->last;
+
+			cs->idle_count++;
+			cs->idle_ns += gap;
+			if (gap > cs->idle_max)
+				cs->idle_max = gap;
+			cs->ex_idle += gap;
+		}
+
+		if ((dir == CAP_DIR_A) && cs->ex_bytes[CAP_DIR_B]) {
+			exchange_end(cs, ts);
+			exchange_begin(cs, ts);
+		}
+
+		for (j = 0; (j < len) && cs->ex_only_ack; j++)
+			if (data[j] != ASCII_ACK)
+				cs->ex_only_ack = false;
+		cs->ex_bytes[dir] += len;
+		cs->bytes[dir] += len;
+		cs->last = ts;
+	}
+
+	for (i = 0; i < 256; i++)
+		if (sessions[i].active)
+			session_report(&sessions[i], i, ++number, r.base);
+
+	printf("%i session%s in %.6fs of capture\n", number,
+	       number == 1 ? "" : "s", last ? (last - r.base) / 1e9 : 0.0);
+
+	free(sessions);
+	cap_close(&r);
+
+	return 0;
+}
+
+/*
+ * Compare mode: check one direction of one pair against a "golden"
+ * capture as it is proxied, so a change to a driver that alters the
+ * wire protocol, or slows it down, shows up straight away.  Live data
+ * is matched byte for byte against the golden records as it is read,
+ * with the reader never more than one record ahead.  The first
+ * difference is reported with its stream offset; timing is compared at
+ * the start of each golden record, relative to the first byte of each
+ * stream.
+ */
+
+static bool compare_next(struct ss_session *s)
+{
+	const struct cap_rec *rec;
+
+	while ((rec = cap_next(&s->compare.r))) {
+		if ((rec->pair != s->compare_pair) ||
+		    (rec->dir != s->compare_dir) || !rec->len)
+			continue;
+
+		s->compare.data = (const char *)(rec + 1);
+		s->compare.len = le32toh(rec->len);
+		s->compare.off = 0;
+		s->compare.ts = le64toh(rec->ts);
+		return true;
+	}
+
+	return false;
+}
+
+static bool compare_start(struct ss_session *s)
+{
+	memset(&s->compare, 0, sizeof(s->compare));
+	if (!cap_open(&s->compare.r, s->compare_file))
+		return false;
+
+	if (!compare_next(s)) {
+		fprintf(stderr, "%s: no %c data for pair %i\n",
+			s->compare_file,
+			s->compare_dir == CAP_DIR_A ? 'A' : 'B',
+			s->compare_pair);
+		cap_close(&s->compare.r);
+		return false;
+	}
+
+	s->compare.golden_start = s->compare.ts;
+	s->compare.open = true;
+
+	return true;
+}
+
+static void compare_diverged(struct ss_session *s, const char *buf, size_t len,
+			     const char *why)
+{
+	char name[16];
+	size_t i;
+
+	capture_name(name, sizeof(name), s->compare_dir, s->compare_pair);
+	printf("*** Compare: %s diverges from %s at offset %" PRIu64
+	       " (%+.3f ms): %s\n", name, s->compare_file, s->compare.offset,
+	       s->compare.delta_ns / 1e6, why);
+
+	printf("    golden:");
+	for (i = 0; (i < 16) && (s->compare.off + i < s->compare.len); i++)
+		printf(" %02x",
+		       (unsigned char)s->compare.data[s->compare.off + i]);
+	printf("\n    live:  ");
+	for (i = 0; (i < 16) && (i < len); i++)
+		printf(" %02x", (unsigned char)buf[i]);
+	printf("\n");
+
+	s->compare.diverged = true;
+}
+
+/* Match @len bytes read from @src at @ts against the golden stream */
+static void compare_data(struct ss_session *s, const struct path *src,
+			 uint64_t ts, const char *buf, size_t len)
+{
+	size_t n;
+	size_t i;
+
+	if (!s->compare.open || s->compare.diverged ||
+	    (src->index != s->compare_pair) || (src->dir != s->compare_dir))
+		return;
+
+	if (!s->compare.live_start)
+		s->compare.live_start = ts;
+
+	while (len > 0) {
+		if ((s->compare.off == s->compare.len) && !compare_next(s)) {
+			s->compare.len = s->compare.off = 0;
+			compare_diverged(s, buf, len, "golden stream ended");
+			return;
+		}
+
+		if (s->compare.off == 0) {
+			s->compare.delta_ns =
+				(int64_t)(ts - s->compare.live_start) -
+				(int64_t)(s->compare.ts -
+					  s->compare.golden_start);
+			if (s->compare.delta_ns > s->compare.worst_ns)
+				s->compare.worst_ns = s->compare.delta_ns;
+			if (s->compare_slack_ns && !s->compare.slow &&
+			    (s->compare.delta_ns >
+			     (int64_t)s->compare_slack_ns)) {
+				printf("*** Compare: %.3f ms behind %s at "
+				       "offset %" PRIu64 "\n",
+				       s->compare.delta_ns / 1e6,
+				       s->compare_file, s->compare.offset);
+				s->compare.slow = true;
+			}
+		}
+
+		n = s->compare.len - s->compare.off;
+		if (n > len)
+			n = len;
+
+		if (memcmp(s->compare.data + s->compare.off, buf, n) != 0) {
+			for (i = 0;
+			     s->compare.data[s->compare.off + i] == buf[i];
+			     i++)
+				;
+			s->compare.off += i;
+			s->compare.offset += i;
+			compare_diverged(s, buf + i, len - i, "bytes differ");
+			return;
+		}
+
+		s->compare.off += n;
+		s->compare.offset += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Returns true if the live stream matched the golden one */
+static bool compare_report(struct ss_session *s)
+{
+	uint64_t total = s->compare.offset;
+	bool ok = !s->compare.diverged && !s->compare.slow;
+
+	if (!s->compare.open)
+		return true;
+
+	if (!s->compare.diverged) {
+		total += s->compare.len - s->compare.off;
+		while (compare_next(s))
+			total += s->compare.len;
+	}
+
+	if (s->compare.diverged)
+		printf("Compare: diverged at offset %" PRIu64 "\n",
+		       s->compare.offset);
+	else if (total > s->compare.offset)
+		printf("Compare: stopped at offset %" PRIu64 " of %" PRIu64
+		       "\n", s->compare.offset, total);
+	else
+		printf("Compare: all %" PRIu64 " bytes match, %+.3f ms "
+		       "from golden at the last record\n",
+		       total, s->compare.delta_ns / 1e6);
+
+	if (s->compare.live_start)
+		printf("Compare: at most %+.3f ms behind golden%s\n",
+		       s->compare.worst_ns / 1e6,
+		       s->compare.slow ? " (over --compare-slack)" : "");
+
+	cap_close(&s->compare.r);
+	s->compare.open = false;
+
+	return ok && (total == s->compare.offset);
+}
+
+/*
+ * Raw log rotation.  The live log is renamed aside and a new one opened
+ * in the forwarding thread (both cheap metadata operations); syncing,
+ * closing and compressing the old file happen on a worker thread so
+ * the disk never holds up the link.
+ */
+
+extern char **environ;
+
+static void compress_log(struct ss_session *s, const char *name)
+{
+	char *gzip_argv[] = { "gzip", "-f", "--", (char *)name, NULL };
+	char *zstd_argv[] = { "zstd", "-q", "-f", "--rm", "--",
+			      (char *)name, NULL };
+	char **argv = STREQ(s->compressor, "zstd") ? zstd_argv : gzip_argv;
+	posix_spawnattr_t attr;
+	sigset_t none;
+	pid_t pid;
+	int status;
+
+	/* Don't pass on the blocked shutdown signals */
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	if (posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ) != 0) {
+		fprintf(stderr, "Failed to run %s on %s\n", argv[0], name);
+		posix_spawnattr_destroy(&attr);
+		return;
+	}
+	posix_spawnattr_destroy(&attr);
+
+	while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR))
+		;
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+		fprintf(stderr, "%s failed on %s\n", argv[0], name);
+}
+
+static void *rotator_thread(void *arg)
+{
+	struct ss_session *s = arg;
+	struct rotator *r = &s->rotator;
+	struct rotated *job;
+
+	pthread_mutex_lock(&r->lock);
+	while (1) {
+		while (!r->head && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (!r->head)
+			break;
+
+		job = r->head;
+		r->head = job->next;
+		if (!r->head)
+			r->tail = &r->head;
+		pthread_mutex_unlock(&r->lock);
+
+		if (fsync(job->fd) < 0)
+			fprintf(stderr, "Failed to sync %s: %m\n", job->name);
+		close(job->fd);
+		if (s->compressor)
+			compress_log(s, job->name);
+		free(job->name);
+		free(job);
+
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+static void rotator_queue(struct ss_session *s, char *name, int fd)
+{
+	struct rotated *job = calloc(1, sizeof(*job));
+
+	if (!job) {
+		close(fd);
+		free(name);
+		return;
+	}
+	job->name = name;
+	job->fd = fd;
+
+	pthread_mutex_lock(&s->rotator.lock);
+	if (!s->rotator.running &&
+	    (pthread_create(&s->rotator.thread, NULL, rotator_thread,
+			    s) == 0))
+		s->rotator.running = true;
+	*s->rotator.tail = job;
+	s->rotator.tail = &job->next;
+	pthread_cond_signal(&s->rotator.cond);
+	pthread_mutex_unlock(&s->rotator.lock);
+}
+
+/* Wait for queued logs to be compressed */
+static void rotator_stop(struct ss_session *s)
+{
+	pthread_mutex_lock(&s->rotator.lock);
+	s->rotator.stop = true;
+	pthread_cond_signal(&s->rotator.cond);
+	pthread_mutex_unlock(&s->rotator.lock);
+
+	if (s->rotator.running)
+		pthread_join(s->rotator.thread, NULL);
+
+	s->rotator.stop = false;
+	s->rotator.running = false;
+}
+
+/* Is @name taken, either as is or already compressed? */
+static bool rotated_exists(const char *name)
+{
+	static const char *const suffixes[] = { "", ".gz", ".zst" };
+	char buf[1100];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		snprintf(buf, sizeof(buf), "%s%s", name, suffixes[i]);
+		if (access(buf, F_OK) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void rotate_log(struct ss_session *s, struct path *path)
+{
+	char stamp[32];
+	char *name;
+	time_t now = time(NULL);
+	int fd;
+	int n;
+
+	/* The append in flight rotates it once it completes */
+	if (path->logging.len) {
+		path->rotate_due = true;
+		return;
+	}
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	if (asprintf(&name, "%s.%s", path->log_name, stamp) < 0)
+		return;
+	for (n = 1; rotated_exists(name); n++) {
+		free(name);
+		if (asprintf(&name, "%s.%s.%i", path->log_name, stamp, n) < 0)
+			return;
+	}
+
+	if (rename(path->log_name, name) < 0) {
+		perror(path->log_name);
+		free(name);
+		return;
+	}
+
+	fd = open(path->log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		/* Keep appending to the renamed file rather than lose data */
+		perror(path->log_name);
+		free(name);
+		return;
+	}
+
+	rotator_queue(s, name, path->rawlog_fd);
+	path->rawlog_fd = fd;
+	path->log_bytes = 0;
+	path->log_opened = now_ns();
+}
+
+/* Account for @count bytes written to the raw log of @path */
+static void log_written(struct ss_session *s, struct path *path, int count)
+{
+	path->log_bytes += count;
+	if (s->rotate_size && (path->log_bytes >= s->rotate_size))
+		rotate_log(s, path);
+}
+
+static void rotate_tick(struct ss_session *s)
+{
+	uint64_t limit = (uint64_t)s->rotate_secs * 1000000000ULL;
+	uint64_t now = now_ns();
+	int i;
+
+	if (!s->rotate_secs)
+		return;
+
+	for (i = 0; i < 2 * s->npairs; i++) {
+		struct pair *pair = &s->pairs[i / 2];
+		struct path *path = i & 1 ? &pair->B : &pair->A;
+
+		if ((path->rawlog_fd >= 0) && path->log_bytes &&
+		    (now - path->log_opened >= limit))
+			rotate_log(s, path);
+	}
+}
+
+static void handle_tick(struct ss_session *s)
+{
+	uint64_t expirations;
+
+	if (read(s->tick_fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	record_flush(s);
+	stats_tick(s);
+	rotate_tick(s);
+}
+
+static bool start_tick(struct ss_session *s, int epfd)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+
+	s->tick_fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->tick_fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	timerfd_settime(s->tick_fd, 0, &its, NULL);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->tick_src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->tick_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+static void chunk_begin(struct path *src, uint64_t ts)
+{
+	if (src->chunk_total == 0) {
+		src->chunk_ts.tv_sec = ts / 1000000000ULL;
+		src->chunk_ts.tv_nsec = ts % 1000000000ULL;
+	}
+}
+
+static void report_chunk(struct ss_session *s, struct path *src, bool timeout)
+{
+	int ret;
+	int count = src->chunk_len;
+
+	if (src->splice) {
+		/* The display copy is only taken now, from the tap pipe */
+		while (src->tap_len > 0) {
+			ret = read(src->tap_pipe[0], src->chunk + src->chunk_len,
+				   src->tap_len);
+			if (ret <= 0)
+				break;
+			src->chunk_len += ret;
+			src->tap_len -= ret;
+		}
+		count = src->chunk_total;
+	}
+
+	if (count == 0)
+		return;
+
+	hist_add(&src->stats.chunk, count);
+	dump_push(s, src, src->chunk, src->chunk_len, count, timeout);
+
+	if (s && s->chunk_fn)
+		s->chunk_fn(s->chunk_opaque, src->name,
+				  src->index, src->dir,
+				  (uint64_t)src->chunk_ts.tv_sec * 1000000000ULL +
+				  src->chunk_ts.tv_nsec,
+				  src->chunk, src->chunk_len, count);
+
+	if ((src->rawlog_fd >= 0) && !src->splice && (s->uring.fd >= 0)) {
+		uring_log(s, src, src->chunk, count);
+	} else if ((src->rawlog_fd >= 0) && !src->splice) {
+		ret = write(src->rawlog_fd, src->chunk, count);
+		if (ret != count)
+			printf("Failed to write %i to %s log",
+			       count,
+			       src->name);
+		else
+			log_written(s, src, count);
+	}
+
+	src->chunk_len = 0;
+	src->chunk_total = 0;
+}
+
+static void arm_timer(struct path *path, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+
+	timerfd_settime(path->timer_fd, 0, &its, NULL);
+}
+
+static size_t fault_queued(const struct fault *f);
+
+/*
+ * A path is not read while its peer has OUTQ_MAX or more queued (or, with
+ * --uring, being written), or its faults hold as much back, so a slow
+ * reader holds up the writer (who sees the line stall, as it would with
+ * flow control) rather than having its data thrown away.
+ */
+static bool throttled(const struct path *src)
+{
+	return (src->peer->out.len + src->peer->sending.len >= OUTQ_MAX) ||
+		(src->fault && (fault_queued(src->fault) >= OUTQ_MAX));
+}
+
+/*
+ * Recompute the epoll interest for @path.  We want it writable only
+ * while something is queued for it, and stop reading it while its own
+ * data is still waiting for the peer: in the pipe in splice mode, or in
+ * the peer's queue once that is full.
+ */
+static void update_events(int epfd, struct path *path)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if ((path->pipe_len == 0) && !throttled(path))
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if ((path->out.len > 0) || (path->peer->pipe_len > 0))
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = &path->io_src;
+
+	epoll_ctl(epfd, EPOLL_CTL_MOD, path->fd, &ev);
+}
+
+static void send_path(struct ss_session *s, int epfd, struct path *dst,
+		      const char *buf, int count)
+{
+	struct outq *q = &dst->out;
+	int ret = 0;
+
+	if (s->uring.fd >= 0) {
+		uring_send(s, dst, buf, count);
+		return;
+	}
+
+	if (q->len == 0) {
+		ret = write(dst->fd, buf, count);
+		if (ret < 0) {
+			if (errno != EAGAIN) {
+				printf("Failed to write %i (%i)\n", count, ret);
+				return;
+			}
+			ret = 0;
+		}
+		if (ret == count)
+			return;
+	}
+
+	if (q->len + count - ret > q->size) {
+		q->size = q->len + count - ret + CHUNK_SIZE;
+		q->buf = realloc(q->buf, q->size);
+		if (!q->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	memcpy(q->buf + q->len, buf + ret, count - ret);
+	q->len += count - ret;
+	if (q->len == (size_t)(count - ret))
+		update_events(epfd, dst);
+	if ((q->len >= OUTQ_MAX) && (q->len - (count - ret) < OUTQ_MAX))
+		update_events(epfd, dst->peer);
+}
+
+static void drain_path(int epfd, struct path *dst)
+{
+	struct outq *q = &dst->out;
+	struct path *src = dst->peer;
+	int ret;
+
+	if (src->pipe_len > 0) {
+		ret = splice(src->fwd_pipe[0], NULL, dst->fd, NULL,
+			     src->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret <= 0)
+			return;
+
+		src->pipe_len -= ret;
+		if (src->pipe_len == 0) {
+			update_events(epfd, dst);
+			update_events(epfd, src);
+		}
+		return;
+	}
+
+	ret = write(dst->fd, q->buf, q->len);
+	if (ret <= 0)
+		return;
+
+	memmove(q->buf, q->buf + ret, q->len - ret);
+	q->len -= ret;
+	if (q->len == 0)
+		update_events(epfd, dst);
+	if ((q->len < OUTQ_MAX) && (q->len + ret >= OUTQ_MAX))
+		update_events(epfd, src);
+}
+
+/*
+ * Fault injection.  Bytes read from a path with a fault spec are
+ * dropped or bit-flipped at random on their way to the peer, and held
+ * in a delivery queue until they are due: after the fixed delay plus
+ * up to the jitter, and no sooner than a line running at the throttled
+ * baud rate (10 bits a byte) would have carried them.  Delivery times
+ * never go backwards, so the peer sees the bytes late but in order.
+ *
+ * Everything else (display, logs, capture, stats) sees the bytes as
+ * they were read.
+ */
+struct fault_rec {
+	uint64_t due;
+	uint32_t len;
+};
+
+struct fault {
+	uint64_t delay_ns;
+	uint64_t jitter_ns;
+	uint64_t drop;		/* Per-byte probability, scaled by 2^32 */
+	uint64_t flip;
+	unsigned int baud;
+	uint64_t rng;
+
+	/* fault_recs, each followed by its data, from head to len */
+	char *buf;
+	size_t head;
+	size_t len;
+	size_t size;
+	uint64_t line_free;	/* When the last queued byte is delivered */
+
+	int timer_fd;
+	struct source src;
+
+	uint64_t dropped;
+	uint64_t flipped;
+	uint64_t delayed;
+	uint64_t overflow;
+};
+
+#define FAULT_MAX	(4 * OUTQ_MAX)
+
+static size_t fault_queued(const struct fault *f)
+{
+	return f->len - f->head;
+}
+
+/* A probability, as a fraction or a percentage, scaled by 2^32 */
+static bool parse_prob(const char *str, uint64_t *prob)
+{
+	char *end;
+	double p = strtod(str, &end);
+
+	if (*end == '%') {
+		p /= 100;
+		end++;
+	}
+	if (*end || (p < 0) || (p > 1))
+		return false;
+
+	*prob = (uint64_t)(p * 4294967296.0);
+
+	return true;
+}
+
+static bool parse_fault(const char *spec, struct path *path)
+{
+	struct fault *f = calloc(1, sizeof(*f));
+	char *copy = strdup(spec);
+	char *save = NULL;
+	char *term;
+	bool ok = true;
+
+	if (!f || !copy) {
+		perror("malloc");
+		return false;
+	}
+
+	f->rng = now_ns() ^ ((uint64_t)(uintptr_t)path << 16);
+	f->timer_fd = -1;
+
+	for (term = strtok_r(copy, ",", &save); term && ok;
+	     term = strtok_r(NULL, ",", &save)) {
+		if (strncmp(term, "delay=", 6) == 0)
+			f->delay_ns = strtoull(term + 6, NULL, 0) * 1000000ULL;
+		else if (strncmp(term, "jitter=", 7) == 0)
+			f->jitter_ns = strtoull(term + 7, NULL, 0) * 1000000ULL;
+		else if (strncmp(term, "drop=", 5) == 0)
+			ok = parse_prob(term + 5, &f->drop);
+		else if (strncmp(term, "flip=", 5) == 0)
+			ok = parse_prob(term + 5, &f->flip);
+		else if (strncmp(term, "baud=", 5) == 0)
+			f->baud = strtoul(term + 5, NULL, 0);
+		else if (strncmp(term, "seed=", 5) == 0)
+			f->rng = strtoull(term + 5, NULL, 0);
+		else
+			ok = false;
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Invalid fault spec '%s'\n", spec);
+		free(copy);
+		free(f);
+		return false;
+	}
+	free(copy);
+
+	/* xorshift gets stuck on zero */
+	if (f->rng == 0)
+		f->rng = 0x9E3779B97F4A7C15ULL;
+
+	free(path->fault);
+	path->fault = f;
+
+	return true;
+}
+
+/* xorshift64*: plenty for deciding which bytes to break */
+static uint32_t fault_rand(struct fault *f)
+{
+	f->rng ^= f->rng >> 12;
+	f->rng ^= f->rng << 25;
+	f->rng ^= f->rng >> 27;
+
+	return (f->rng * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static int fault_mangle(struct fault *f, const char *buf, int len,
+			char *out)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (f->drop && (fault_rand(f) < f->drop)) {
+			f->dropped++;
+			continue;
+		}
+		out[n] = buf[i];
+		if (f->flip && (fault_rand(f) < f->flip)) {
+			out[n] ^= 1 << (fault_rand(f) & 7);
+			f->flipped++;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+static void fault_arm(struct fault *f)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (f->head < f->len) {
+		const struct fault_rec *rec = (void *)(f->buf + f->head);
+
+		its.it_value.tv_sec = rec->due / 1000000000ULL;
+		its.it_value.tv_nsec = rec->due % 1000000000ULL;
+		/* An all-zero value would disarm the timer */
+		if (rec->due == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(f->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static bool fault_queue(struct fault *f, uint64_t due, const char *data,
+			int len)
+{
+	size_t need = REC_ALIGN(sizeof(struct fault_rec) + len);
+	struct fault_rec *rec;
+
+	if (fault_queued(f) + need > FAULT_MAX) {
+		f->overflow += len;
+		return false;
+	}
+
+	if (f->head == f->len) {
+		f->head = f->len = 0;
+	} else if ((f->len + need > f->size) && (f->head > 0)) {
+		memmove(f->buf, f->buf + f->head, f->len - f->head);
+		f->len -= f->head;
+		f->head = 0;
+	}
+
+	if (f->len + need > f->size) {
+		f->size = f->len + need + CHUNK_SIZE;
+		f->buf = realloc(f->buf, f->size);
+		if (!f->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	rec = (void *)(f->buf + f->len);
+	rec->due = due;
+	rec->len = len;
+	memcpy(rec + 1, data, len);
+	f->len += need;
+	f->delayed += len;
+
+	return true;
+}
+
+/* Pass @buf from @src on to its peer, through @src's faults */
+static void fault_send(struct ss_session *s, int epfd, struct path *src,
+		       const char *buf, int len)
+{
+	struct fault *f = src->fault;
+	char out[CHUNK_SIZE];
+	bool idle = f->head == f->len;
+	uint64_t now = now_ns();
+	bool held = throttled(src);
+	uint64_t due;
+	int piece = len;
+	int off;
+	int n;
+
+	len = fault_mangle(f, buf, len, out);
+	if (len == 0)
+		return;
+
+	due = now + f->delay_ns;
+	if (f->jitter_ns)
+		due += fault_rand(f) % (f->jitter_ns + 1);
+
+	if (idle && (due <= now) && !f->baud) {
+		send_path(s, epfd, src->peer, out, len);
+		return;
+	}
+
+	/* Throttled data is released about a millisecond's worth at a time */
+	if (f->baud)
+		piece = f->baud / 10000 ? f->baud / 10000 : 1;
+
+	for (off = 0; off < len; off += n) {
+		uint64_t start = due > f->line_free ? due : f->line_free;
+
+		n = len - off < piece ? len - off : piece;
+		if (f->baud)
+			start += n * 10000000000ULL / f->baud;
+		if (!fault_queue(f, start, out + off, n))
+			break;
+		f->line_free = start;
+	}
+
+	if (idle)
+		fault_arm(f);
+	/* With --uring, the read completion sees it is throttled */
+	if (!held && throttled(src) && (s->uring.fd < 0))
+		update_events(epfd, src);
+}
+
+static void uring_resume(struct ss_session *s, struct path *src);
+
+/* Deliver everything that is due, or with @all, everything queued */
+static void fault_deliver(struct ss_session *s, int epfd, struct path *src,
+			  bool all)
+{
+	struct fault *f = src->fault;
+	uint64_t now = now_ns();
+	bool held = throttled(src);
+
+	while (f->head < f->len) {
+		const struct fault_rec *rec = (void *)(f->buf + f->head);
+
+		if (!all && (rec->due > now))
+			break;
+		send_path(s, epfd, src->peer, (const char *)(rec + 1),
+			  rec->len);
+		f->head += REC_ALIGN(sizeof(*rec) + rec->len);
+	}
+
+	fault_arm(f);
+	if (held && !throttled(src)) {
+		if (s->uring.fd >= 0)
+			uring_resume(s, src);
+		else
+			update_events(epfd, src);
+	}
+}
+
+static void handle_fault(struct ss_session *s, int epfd, struct path *path)
+{
+	uint64_t expirations;
+
+	if (read(path->fault->timer_fd, &expirations,
+		 sizeof(expirations)) > 0)
+		fault_deliver(s, epfd, path, false);
+}
+
+/* The pair is gone: forget what was queued and stop the timer */
+static void fault_discard(struct fault *f)
+{
+	if (!f)
+		return;
+	f->head = f->len = 0;
+	fault_arm(f);
+}
+
+static void fault_report(const struct path *path)
+{
+	const struct fault *f = path->fault;
+
+	if (!f)
+		return;
+
+	printf("%s faults: %" PRIu64 " dropped, %" PRIu64 " flipped, "
+	       "%" PRIu64 " delayed",
+	       path->name, f->dropped, f->flipped, f->delayed);
+	if (f->overflow)
+		printf(", %" PRIu64 " lost to a full queue", f->overflow);
+	printf("\n");
+}
+
+static void free_fault(struct fault *f)
+{
+	if (!f)
+		return;
+	if (f->timer_fd >= 0)
+		close(f->timer_fd);
+	free(f->buf);
+	free(f);
+}
+
+static int forward(struct ss_session *s, int epfd, struct path *src,
+		   uint64_t ready);
+
+static void splice_log(struct ss_session *s, struct path *src, int count)
+{
+	int ret;
+
+	ret = tee(src->fwd_pipe[0], src->log_pipe[1], count, 0);
+	while (ret > 0) {
+		int n = splice(src->log_pipe[0], NULL, src->rawlog_fd, NULL,
+			       ret, SPLICE_F_MOVE);
+		if (n <= 0) {
+			printf("Failed to write %i to %s log", ret, src->name);
+			break;
+		}
+		ret -= n;
+		log_written(s, src, n);
+	}
+}
+
+static void splice_tap(struct ss_session *s, struct path *src, int count)
+{
+	int room = s->splice_sample - src->tap_len - src->chunk_len;
+	int ret;
+
+	if (room <= 0)
+		return;
+
+	ret = tee(src->fwd_pipe[0], src->tap_pipe[1],
+		  count < room ? count : room, SPLICE_F_NONBLOCK);
+	if (ret > 0)
+		src->tap_len += ret;
+}
+
+/*
+ * Zero-copy variant of forward(): data is moved from @src into a pipe,
+ * tee()d to the raw log and (up to splice_sample bytes per chunk) to a
+ * display tap, and then spliced to the peer.  None of it passes through
+ * user space except the sample, which is read when the chunk is
+ * reported.  If the peer cannot take all of it, @src is not read again
+ * until the pipe has drained.
+ *
+ * Falls back to forward() for paths whose driver cannot splice.
+ */
+static int forward_splice(struct ss_session *s, int epfd, struct path *src,
+			  uint64_t ready)
+{
+	struct path *dst = src->peer;
+	uint64_t ts;
+	int ret;
+
+	ret = splice(src->fd, NULL, src->fwd_pipe[1], NULL, CHUNK_SIZE,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == EINVAL) {
+			printf("%s cannot splice, copying instead\n",
+			       src->name);
+			src->splice = false;
+			return forward(s, epfd, src, ready);
+		}
+		return -1;
+	} else if (ret == 0) {
+		return -1;
+	}
+
+	ts = ready;
+	chunk_begin(src, ts);
+	src->pipe_len = ret;
+	src->chunk_total += ret;
+	stats_read(src, ts, ret);
+
+	if (src->rawlog_fd >= 0)
+		splice_log(s, src, ret);
+	record_pipe(s, src, ts, ret);
+	splice_tap(s, src, ret);
+
+	while (src->pipe_len > 0) {
+		int n = splice(src->fwd_pipe[0], NULL, dst->fd, NULL,
+			       src->pipe_len,
+			       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n <= 0)
+			break;
+		src->pipe_len -= n;
+	}
+
+	if (src->pipe_len > 0) {
+		update_events(epfd, src);
+		update_events(epfd, dst);
+	}
+
+	if (src->chunk_total >= CHUNK_SIZE)
+		report_chunk(s, src, false);
+	else if (s->window_ms == 0)
+		report_chunk(s, src, false);
+	else
+		arm_timer(src, s->window_ms);
+
+	return ret;
+}
+
+/*
+ * Read from a socket with SO_TIMESTAMPING enabled, setting @ts to when
+ * the kernel received the (last of the) data.  Software timestamps are
+ * on CLOCK_REALTIME, so they are moved onto stamp_ns()'s clock.  @ts is
+ * left alone if the kernel did not say.
+ */
+static int recv_stamped(struct path *src, char *buf, size_t len,
+			uint64_t *ts)
+{
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct timespec real;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ret = recvmsg(src->fd, &msg, 0);
+	if (ret <= 0)
+		return ret;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		struct scm_timestamping tss;
+		uint64_t rx;
+		uint64_t age;
+
+		if ((cmsg->cmsg_level != SOL_SOCKET) ||
+		    (cmsg->cmsg_type != SO_TIMESTAMPING))
+			continue;
+
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+		if (!tss.ts[0].tv_sec && !tss.ts[0].tv_nsec)
+			continue;
+
+		clock_gettime(CLOCK_REALTIME, &real);
+		rx = (uint64_t)tss.ts[0].tv_sec * 1000000000ULL +
+			tss.ts[0].tv_nsec;
+		age = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+		age = age > rx ? age - rx : 0;
+		*ts = stamp_ns() - age;
+	}
+
+	return ret;
+}
+
+/*
+ * Pass @len bytes read from @src at @ts straight on to the peer, and
+ * gather them into a chunk for display and logging, which is reported
+ * once the line has been quiet for the coalescing window (or the chunk
+ * fills up).
+ */
+static void forward_data(struct ss_session *s, int epfd, struct path *src,
+			 const char *buf, int len, uint64_t ts)
+{
+	int off;
+	int n;
+
+	if (src->fault)
+		fault_send(s, epfd, src, buf, len);
+	else
+		send_path(s, epfd, src->peer, buf, len);
+	stats_read(src, ts, len);
+	record_data(s, src, ts, buf, len);
+
+	for (off = 0; off < len; off += n) {
+		n = sizeof(src->chunk) - src->chunk_len;
+		if (n > len - off)
+			n = len - off;
+		chunk_begin(src, ts);
+		memcpy(src->chunk + src->chunk_len, buf + off, n);
+		src->chunk_len += n;
+		src->chunk_total += n;
+
+		if (src->chunk_len == sizeof(src->chunk))
+			report_chunk(s, src, false);
+	}
+}
+
+/* Called once nothing more can be read from @src for now */
+static void forward_done(struct ss_session *s, struct path *src)
+{
+	if (s->window_ms == 0)
+		report_chunk(s, src, false);
+	else if (src->chunk_len)
+		arm_timer(src, s->window_ms);
+}
+
+/*
+ * Read everything that is available on @src and forward it.
+ *
+ * The first read is timestamped with @ready, taken as soon as epoll
+ * said @src was readable, rather than after whatever else was handled
+ * first; sockets use the kernel's receive timestamp where there is one.
+ *
+ * Stops early, to be called again once the peer has caught up, if the
+ * peer's queue fills.
+ *
+ * Returns the number of bytes read, or -1 on EOF/error.
+ */
+static int forward(struct ss_session *s, int epfd, struct path *src,
+		   uint64_t ready)
+{
+	char buf[CHUNK_SIZE];
+	uint64_t ts;
+	int total = 0;
+	int ret;
+
+	if (src->splice)
+		return forward_splice(s, epfd, src, ready);
+
+	while (!throttled(src) || src->hungup) {
+		ts = total ? 0 : ready;
+		if (src->kernel_ts)
+			ret = recv_stamped(src, buf, sizeof(buf), &ts);
+		else
+			ret = read(src->fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return total ? total : -1;
+		} else if (ret == 0) {
+			return total ? total : -1;
+		}
+
+		if (!ts)
+			ts = stamp_ns();
+		forward_data(s, epfd, src, buf, ret, ts);
+		total += ret;
+	}
+
+	forward_done(s, src);
+
+	return total;
+}
+
+/*
+ * Ask for receive timestamps on sockets.  Only the software stamp is
+ * used: a NIC's hardware stamps are on its own clock, not the system's.
+ */
+static void enable_kernel_ts(struct path *path)
+{
+#ifdef SO_TIMESTAMPING
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	struct stat st;
+
+	if ((fstat(path->fd, &st) < 0) || !S_ISSOCK(st.st_mode))
+		return;
+
+	if (setsockopt(path->fd, SOL_SOCKET, SO_TIMESTAMPING,
+		       &flags, sizeof(flags)) == 0)
+		path->kernel_ts = true;
+#endif
+}
+
+static bool watch_path(struct ss_session *s, int epfd, struct path *path)
+{
+	struct epoll_event ev;
+	int flags;
+
+	/* io_uring waits on the descriptor itself, rather than fail EAGAIN */
+	flags = fcntl(path->fd, F_GETFL);
+	if (s->uring.fd >= 0)
+		flags &= ~O_NONBLOCK;
+	else
+		flags |= O_NONBLOCK;
+	if (fcntl(path->fd, F_SETFL, flags) < 0) {
+		perror(path->name);
+		return false;
+	}
+
+	if (s->uring.fd < 0)
+		enable_kernel_ts(path);
+
+	/* Faults need the data in user space, as does io_uring */
+	if (s->use_splice && !path->fault && (s->uring.fd < 0)) {
+		if ((pipe2(path->fwd_pipe, O_CLOEXEC) < 0) ||
+		    (pipe2(path->log_pipe, O_CLOEXEC) < 0) ||
+		    (pipe2(path->tap_pipe, O_CLOEXEC | O_NONBLOCK) < 0) ||
+		    (pipe2(path->cap_pipe, O_CLOEXEC) < 0)) {
+			perror("pipe2");
+			return false;
+		}
+		path->splice = true;
+	}
+
+	path->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (path->timer_fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+
+	path->io_src.type = SRC_PATH;
+	path->io_src.path = path;
+	path->timer_src.type = SRC_TIMER;
+	path->timer_src.path = path;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = &path->io_src;
+
+	/*
+	 * io_uring reads it, but a pty master's hangup never completes a
+	 * read, so epoll still watches for that.
+	 */
+	if (s->uring.fd >= 0) {
+		uring_arm_read(s, path);
+		ev.events = EPOLLRDHUP;
+	}
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, path->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &path->timer_src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, path->timer_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	if (!path->fault)
+		return true;
+
+	path->fault->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (path->fault->timer_fd < 0) {
+		perror("timerfd_create");
+		return false;
+	}
+
+	path->fault->src.type = SRC_FAULT;
+	path->fault->src.path = path;
+	ev.data.ptr = &path->fault->src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, path->fault->timer_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+static void unwatch_pair(struct ss_session *s, int epfd, struct path *path)
+{
+	struct path *peer = path->peer;
+
+	report_chunk(s, path, false);
+	report_chunk(s, peer, false);
+
+	path->closed = peer->closed = true;
+	if (s->uring.fd >= 0) {
+		uring_cancel_read(s, path);
+		uring_cancel_read(s, peer);
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, path->fd, NULL);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, peer->fd, NULL);
+	close(path->timer_fd);
+	close(peer->timer_fd);
+	path->timer_fd = peer->timer_fd = -1;
+	fault_discard(path->fault);
+	fault_discard(peer->fault);
+	printf("%s closed, dropping %s<->%s\n",
+	       path->name, path->name, peer->name);
+}
+
+static void close_pipe(int *fds)
+{
+	if (fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	fds[0] = fds[1] = -1;
+}
+
+/* Give back what watch_path() set up, so the next run starts afresh */
+static void unwatch_path(struct path *path)
+{
+	if (path->timer_fd >= 0)
+		close(path->timer_fd);
+	path->timer_fd = -1;
+	if (path->fault && (path->fault->timer_fd >= 0)) {
+		close(path->fault->timer_fd);
+		path->fault->timer_fd = -1;
+	}
+
+	close_pipe(path->fwd_pipe);
+	close_pipe(path->log_pipe);
+	close_pipe(path->tap_pipe);
+	close_pipe(path->cap_pipe);
+	path->splice = false;
+	path->pipe_len = path->tap_len = 0;
+	path->read_armed = path->read_held = false;
+}
+
+static void handle_path(struct ss_session *s, int epfd, struct path *path,
+			uint32_t events, uint64_t ready)
+{
+	int count = 0;
+
+	/* Nothing more will follow, so what is left is read regardless */
+	if ((events & (EPOLLHUP | EPOLLERR)) && (s->uring.fd < 0))
+		path->hungup = true;
+
+	if (events & EPOLLOUT)
+		drain_path(epfd, path);
+
+	if ((events & EPOLLIN) || (path->hungup && !path->pipe_len))
+		count = forward(s, epfd, path, ready);
+
+	if ((count < 0) ||
+	    ((count == 0) && (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))))
+		unwatch_pair(s, epfd, path);
+}
+
+static void handle_timer(struct ss_session *s, struct path *path)
+{
+	uint64_t expirations;
+
+	if (read(path->timer_fd, &expirations, sizeof(expirations)) > 0)
+		report_chunk(s, path, true);
+}
+
+/*
+ * io_uring completions.  Reads are forwarded just as forward() would
+ * have, stamped with when epoll reported the ring ready, and their
+ * buffer handed straight back to the kernel.
+ */
+#ifdef HAVE_URING
+
+/* Returns true if @path's pair has closed */
+static bool uring_read_done(struct ss_session *s, int epfd, struct path *path,
+			    int res, unsigned int flags, uint64_t ready)
+{
+	unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	const char *buf = path->ubuf;
+
+	if (flags & IORING_CQE_F_BUFFER)
+		buf = s->uring.bufs + bid * CHUNK_SIZE;
+
+	if ((res > 0) && !path->closed) {
+		forward_data(s, epfd, path, buf, res, ready);
+		forward_done(s, path);
+	}
+
+	if (flags & IORING_CQE_F_BUFFER)
+		uring_return_buf(s, bid);
+
+	if (!(flags & IORING_CQE_F_MORE))
+		path->read_armed = false;
+
+	if (path->closed || s->uring.stopping)
+		return false;
+
+	/* Stop reading while the peer is behind, until uring_resume() */
+	if (!path->read_held && throttled(path)) {
+		path->read_held = true;
+		if (path->read_armed)
+			uring_cancel_read(s, path);
+	}
+
+	if (path->read_armed)
+		return false;
+
+	/* A multishot read also ends when the buffers run out */
+	if ((res > 0) || (res == -EAGAIN) || (res == -EINTR) ||
+	    (res == -ENOBUFS) || (res == -ECANCELED)) {
+		if (!path->read_held)
+			uring_arm_read(s, path);
+		return false;
+	}
+
+	unwatch_pair(s, epfd, path);
+
+	return true;
+}
+
+/* Read @src again once what it sent has drained below OUTQ_MAX */
+static void uring_resume(struct ss_session *s, struct path *src)
+{
+	if (!src->read_held || src->closed || throttled(src))
+		return;
+
+	src->read_held = false;
+	if (!src->read_armed)
+		uring_arm_read(s, src);
+}
+
+static void uring_write_done(struct ss_session *s, struct path *dst, int res)
+{
+	struct outq *q = &dst->sending;
+
+	if (dst->closed) {
+		q->len = dst->out.len = 0;
+		return;
+	}
+
+	if ((res == -EINTR) || (res == -EAGAIN)) {
+		uring_write(s, dst->fd, q, UR_DATA(dst, UR_WRITE));
+	} else if (res <= 0) {
+		printf("Failed to write %zu (%i)\n", q->len, res);
+		q->len = 0;
+	} else if ((size_t)res < q->len) {
+		memmove(q->buf, q->buf + res, q->len - res);
+		q->len -= res;
+		uring_write(s, dst->fd, q, UR_DATA(dst, UR_WRITE));
+	} else {
+		q->len = 0;
+	}
+
+	uring_send_next(s, dst);
+	uring_resume(s, dst->peer);
+}
+
+static void uring_log_done(struct ss_session *s, struct path *path, int res)
+{
+	struct outq *q = &path->logging;
+
+	if (res <= 0) {
+		printf("Failed to write %zu to %s log", q->len, path->name);
+		q->len = 0;
+	} else if ((size_t)res < q->len) {
+		memmove(q->buf, q->buf + res, q->len - res);
+		q->len -= res;
+		log_written(s, path, res);
+		uring_write(s, path->rawlog_fd, q, UR_DATA(path, UR_LOG));
+		return;
+	} else {
+		q->len = 0;
+		log_written(s, path, res);
+	}
+
+	/* Rotation waits for the append in flight to the old file */
+	if (path->rotate_due) {
+		path->rotate_due = false;
+		rotate_log(s, path);
+	}
+
+	uring_log_next(s, path);
+}
+
+/* Handle every completion posted; returns the number of pairs closed */
+static int uring_reap(struct ss_session *s, int epfd, uint64_t ready)
+{
+	unsigned int head = *s->uring.cq_head;
+	struct io_uring_cqe cqe;
+	struct path *path;
+	int closed = 0;
+
+	while (1) {
+		if (head == __atomic_load_n(s->uring.cq_tail,
+					    __ATOMIC_ACQUIRE)) {
+			/* Completions that did not fit are flushed on entry */
+			if (!(__atomic_load_n(s->uring.sq_flags,
+					      __ATOMIC_RELAXED) &
+			      IORING_SQ_CQ_OVERFLOW))
+				break;
+			uring_enter(s, 0, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		cqe = s->uring.cqes[head & s->uring.cq_mask];
+		__atomic_store_n(s->uring.cq_head, ++head, __ATOMIC_RELEASE);
+
+		path = UR_PATH(cqe.user_data);
+		switch (UR_OP(cqe.user_data)) {
+		case UR_READ:
+			if (uring_read_done(s, epfd, path, cqe.res, cqe.flags,
+					    ready))
+				closed++;
+			break;
+		case UR_WRITE:
+			uring_write_done(s, path, cqe.res);
+			break;
+		case UR_LOG:
+			uring_log_done(s, path, cqe.res);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return closed;
+}
+
+/* Whether anything is still to be written to a path or a raw log */
+static bool uring_busy(struct ss_session *s, bool logs_only)
+{
+	int i;
+
+	for (i = 0; i < 2 * s->npairs; i++) {
+		struct pair *pair = &s->pairs[i / 2];
+		struct path *path = i & 1 ? &pair->B : &pair->A;
+
+		if (path->logging.len || path->log_out.len)
+			return true;
+		if (!logs_only && !path->closed &&
+		    (path->sending.len || path->out.len))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Give queued writes (or only the log appends) a bounded chance to
+ * complete.  Reads that complete meanwhile are still forwarded, but
+ * once stopping they are not re-armed.
+ */
+static void uring_drain(struct ss_session *s, int epfd,
+			bool logs_only)
+{
+	uint64_t deadline = now_ns() + 1000000000ULL;
+	struct pollfd pfd;
+	int i;
+
+	if (s->uring.fd < 0)
+		return;
+
+	if (!s->uring.stopping) {
+		s->uring.stopping = true;
+		for (i = 0; i < 2 * s->npairs; i++) {
+			struct path *path = i & 1 ? &s->pairs[i / 2].B :
+						    &s->pairs[i / 2].A;
+
+			if (!path->closed)
+				uring_cancel_read(s, path);
+		}
+	}
+
+	pfd.fd = s->uring.fd;
+	pfd.events = POLLIN;
+
+	do {
+		uring_submit(s);
+		if (!uring_busy(s, logs_only))
+			break;
+		poll(&pfd, 1, 10);
+		uring_reap(s, epfd, stamp_ns());
+	} while (now_ns() < deadline);
+}
+
+#else
+
+static int uring_reap(struct ss_session *s, int epfd, uint64_t ready)
+{
+	return 0;
+}
+
+static void uring_resume(struct ss_session *s, struct path *src)
+{
+}
+
+static void uring_drain(struct ss_session *s, int epfd,
+			bool logs_only)
+{
+}
+
+#endif
+
+/*
+ * Must be called before any thread is started, so they all inherit it.
+ * The caller's mask is kept for release_signals() to put back.
+ */
+static bool block_signals(struct ss_session *s)
+{
+	sigemptyset(&s->shutdown_sigs);
+	sigaddset(&s->shutdown_sigs, SIGINT);
+	sigaddset(&s->shutdown_sigs, SIGTERM);
+	sigaddset(&s->shutdown_sigs, SIGHUP);
+
+	if (sigprocmask(SIG_BLOCK, &s->shutdown_sigs, &s->saved_sigs) < 0) {
+		perror("sigprocmask");
+		return false;
+	}
+	s->sigs_saved = true;
+
+	s->signal_fd = signalfd(-1, &s->shutdown_sigs,
+				SFD_NONBLOCK | SFD_CLOEXEC);
+	if (s->signal_fd < 0) {
+		perror("signalfd");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Anything still pending asked for the shutdown that is already under
+ * way, so consume it rather than have it delivered once unblocked.
+ */
+static void release_signals(struct ss_session *s)
+{
+	struct signalfd_siginfo si;
+
+	if (s->signal_fd >= 0) {
+		while (read(s->signal_fd, &si, sizeof(si)) == sizeof(si))
+			;
+		close(s->signal_fd);
+		s->signal_fd = -1;
+	}
+
+	if (s->sigs_saved)
+		sigprocmask(SIG_SETMASK, &s->saved_sigs, NULL);
+	s->sigs_saved = false;
+}
+
+static bool start_signals(struct ss_session *s, int epfd)
+{
+	struct epoll_event ev;
+
+	if (s->signal_fd < 0)
+		return true;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->signal_src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->signal_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+/* ss_stop() wakes the event loop through an eventfd */
+static bool start_stop(struct ss_session *s, int epfd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->stop_src;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->stop_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	return true;
+}
+
+/* Returns true if the proxy should shut down */
+static bool handle_signal(struct ss_session *s)
+{
+	struct signalfd_siginfo si;
+
+	if (read(s->signal_fd, &si, sizeof(si)) != sizeof(si))
+		return false;
+
+	printf("Caught %s, shutting down\n", strsignal(si.ssi_signo));
+
+	return true;
+}
+
+/*
+ * Replay and emulation poll() their one pty rather than use epoll, so
+ * they watch the stop and signal descriptors through these two.
+ */
+static void watch_stop(struct ss_session *s, struct pollfd *pfd)
+{
+	pfd[0].fd = s->stop_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s->signal_fd;
+	pfd[1].events = POLLIN;
+}
+
+/* Returns true if the descriptors from watch_stop() ask us to stop */
+static bool stop_wanted(struct ss_session *s, const struct pollfd *pfd)
+{
+	if (pfd[0].revents & POLLIN)
+		return true;
+
+	return (pfd[1].revents & POLLIN) && handle_signal(s);
+}
+
+/*
+ * On the way out, give data that has already been read a bounded
+ * chance to reach its destination, then report any partial chunks so
+ * they make it to the display and the raw logs.
+ */
+static void shutdown_drain(struct ss_session *s, int epfd)
+{
+	uint64_t deadline = now_ns() + 1000000000ULL;
+	struct pollfd *pfds;
+	int n;
+	int i;
+
+	pfds = calloc(2 * s->npairs, sizeof(*pfds));
+	if (!pfds)
+		return;
+
+	/* Injected delays are not worth waiting for on the way out */
+	for (i = 0; i < s->npairs; i++) {
+		if (s->pairs[i].A.fault && !s->pairs[i].A.closed)
+			fault_deliver(s, epfd, &s->pairs[i].A, true);
+		if (s->pairs[i].B.fault && !s->pairs[i].B.closed)
+			fault_deliver(s, epfd, &s->pairs[i].B, true);
+	}
+
+	/* With --uring, writes are already queued and need only reaping */
+	uring_drain(s, epfd, false);
+
+	while ((s->uring.fd < 0) && (now_ns() < deadline)) {
+		n = 0;
+		for (i = 0; i < 2 * s->npairs; i++) {
+			struct path *dst = i & 1 ? &s->pairs[i / 2].B :
+						   &s->pairs[i / 2].A;
+
+			if (dst->closed || dst->peer->closed)
+				continue;
+			if (dst->out.len || dst->peer->pipe_len) {
+				drain_path(epfd, dst);
+				if (!dst->out.len && !dst->peer->pipe_len)
+					continue;
+				pfds[n].fd = dst->fd;
+				pfds[n].events = POLLOUT;
+				n++;
+			}
+		}
+
+		if (n == 0)
+			break;
+		poll(pfds, n, 10);
+	}
+
+	free(pfds);
+
+	for (i = 0; i < s->npairs; i++) {
+		report_chunk(s, &s->pairs[i].A, false);
+		report_chunk(s, &s->pairs[i].B, false);
+	}
+}
+
+static void sync_fd(int fd, const char *what)
+{
+	if ((fd >= 0) && (fsync(fd) < 0) && (errno != EINVAL))
+		fprintf(stderr, "Failed to sync %s: %m\n", what);
+}
+
+/* Make sure everything recorded so far is on stable storage */
+static void sync_outputs(struct ss_session *s)
+{
+	int i;
+
+	record_flush(s);
+
+	for (i = 0; i < s->npairs; i++) {
+		sync_fd(s->pairs[i].A.rawlog_fd, s->pairs[i].A.name);
+		sync_fd(s->pairs[i].B.rawlog_fd, s->pairs[i].B.name);
+	}
+	sync_fd(s->capture.fd, "capture");
+	sync_fd(s->pcapng.fd, "pcapng");
+}
+
+/*
+ * Publish where every pair's ends are, as JSON, once they are all being
+ * forwarded.  Like the stats file it is replaced atomically, so a test
+ * harness can wait for it to appear and then read it.  It is removed
+ * when we exit.
+ */
+static void state_write(struct ss_session *s)
+{
+	char tmp[1100];
+	FILE *f;
+	int i;
+
+	if (!s->state_file)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", s->state_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+
+	fprintf(f, "{\"pid\": %i, \"pairs\": [\n", (int)getpid());
+	for (i = 0; i < s->npairs; i++)
+		fprintf(f, "    {\"A\": {\"name\": \"%s\", \"path\": \"%s\"}, "
+			"\"B\": {\"name\": \"%s\", \"path\": \"%s\"}}%s\n",
+			s->pairs[i].A.name, s->pairs[i].A.path,
+			s->pairs[i].B.name, s->pairs[i].B.path,
+			i + 1 < s->npairs ? "," : "");
+	fprintf(f, "]}\n");
+
+	if (fclose(f) != 0) {
+		perror(tmp);
+		return;
+	}
+	if (rename(tmp, s->state_file) < 0)
+		perror(s->state_file);
+}
+
+/*
+ * Each path is registered with epoll carrying a pointer to itself, so
+ * dispatching an event costs the same no matter how many pairs (and
+ * descriptors) are being proxied.  All descriptors are non-blocking;
+ * the only waiting done is in epoll_wait().
+ */
+static void proxy(struct ss_session *s)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int epfd;
+	int active = s->npairs;
+	bool stopping = false;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+
+	if (!start_tick(s, epfd) || !start_stop(s, epfd))
+		goto out;
+
+	if (!start_signals(s, epfd))
+		goto out;
+
+	pcapng_start(s);
+
+	if (!observe_start(s, epfd) || !filter_start(s))
+		goto out;
+
+	if (s->uring_entries && !uring_start(s, epfd))
+		goto out;
+
+	for (i = 0; i < s->npairs; i++) {
+		s->pairs[i].A.peer = &s->pairs[i].B;
+		s->pairs[i].B.peer = &s->pairs[i].A;
+		s->pairs[i].A.index = s->pairs[i].B.index = i;
+		s->pairs[i].A.dir = CAP_DIR_A;
+		s->pairs[i].B.dir = CAP_DIR_B;
+
+		/* Dropped by an earlier run */
+		if (s->pairs[i].A.closed) {
+			active--;
+			continue;
+		}
+
+		if (!watch_path(s, epfd, &s->pairs[i].A) ||
+		    !watch_path(s, epfd, &s->pairs[i].B))
+			goto out;
+	}
+
+	uring_submit(s);
+	state_write(s);
+
+	while ((active > 0) && !stopping) {
+		uint64_t ready;
+		int ret;
+
+		ret = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		ready = stamp_ns();
+
+		/* Ahead of any hangup, so the last reads are forwarded */
+		if (s->uring.fd >= 0)
+			active -= uring_reap(s, epfd, ready);
+
+		for (i = 0; i < ret; i++) {
+			struct source *src = events[i].data.ptr;
+			struct path *path = src->path;
+
+			if (src->type == SRC_TICK) {
+				handle_tick(s);
+				continue;
+			} else if (src->type == SRC_LISTEN) {
+				handle_listen(s);
+				continue;
+			} else if (src->type == SRC_OBSERVER) {
+				handle_observer(s, src->priv, events[i].events);
+				continue;
+			} else if (src->type == SRC_SIGNAL) {
+				stopping = handle_signal(s);
+				continue;
+			} else if (src->type == SRC_STOP) {
+				stopping = true;
+				continue;
+			} else if (src->type == SRC_URING) {
+				continue;
+			}
+
+			if (path->closed)
+				continue;
+
+			switch (src->type) {
+			case SRC_PATH:
+				handle_path(s, epfd, path, events[i].events,
+					    ready);
+				if (path->closed)
+					active--;
+				break;
+			case SRC_TIMER:
+				handle_timer(s, path);
+				break;
+			case SRC_FAULT:
+				handle_fault(s, epfd, path);
+				break;
+			default:
+				break;
+			}
+		}
+
+		/* Everything queued while handling events, in one go */
+		uring_submit(s);
+	}
+
+	if (stopping)
+		shutdown_drain(s, epfd);
+ out:
+	uring_drain(s, epfd, true);
+	uring_stop(s);
+
+	while (s->observe.clients)
+		observer_close(s, s->observe.clients);
+	for (i = 0; i < s->npairs; i++) {
+		unwatch_path(&s->pairs[i].A);
+		unwatch_path(&s->pairs[i].B);
+	}
+	if (s->tick_fd >= 0)
+		close(s->tick_fd);
+	s->tick_fd = -1;
+	close(epfd);
+}
+
+static bool open_pty(struct ss_session *s, struct path *path)
+{
+#ifdef MACOS
+	char	*ptsname_path;
+#endif
+
+	path->fd = posix_openpt(O_RDWR);
+	if (path->fd < 0) {
+		perror("posix_openpt");
+		return false;
+	}
+
+	grantpt(path->fd);
+	unlockpt(path->fd);
+
+#ifdef MACOS
+	ptsname_path = ptsname(path->fd);
+	strncpy(path->path,ptsname_path,sizeof(path->path) - 1);
+#else
+	ptsname_r(path->fd, path->path, sizeof(path->path));
+#endif
+
+	/*
+	 * Hold the slave open ourselves so the master does not report a
+	 * hangup until (and between the times) a client has it open.
+	 * Start it raw: a cooked slave would sit on data until a newline
+	 * and echo what we forward to it straight back to us.
+	 */
+	path->hold_fd = open(path->path, O_RDWR | O_NOCTTY);
+	if (path->hold_fd >= 0) {
+		struct termios tios;
+
+		if (tcgetattr(path->hold_fd, &tios) == 0) {
+			cfmakeraw(&tios);
+			tcsetattr(path->hold_fd, TCSANOW, &tios);
+		}
+	}
+
+	fprintf(stderr, "%s\n", path->path);
+	if (s && s->pty_fn)
+		s->pty_fn(s->pty_opaque, path->name, path->path);
+
+	return true;
+}
+
+static void replay_drain(struct ss_session *s, struct path *path,
+			 uint64_t *received)
+{
+	char buf[CHUNK_SIZE];
+	int ret;
+
+	while ((ret = read(path->fd, buf, sizeof(buf))) > 0) {
+		*received += ret;
+		if (!s->quiescent)
+			printf("%s %i:\n", path->name, ret);
+		hexdump(s, buf, ret, stdout);
+	}
+}
+
+/*
+ * Wait, while consuming whatever the client sends, until either @want
+ * bytes have been received in total or (if @want is zero) the
+ * CLOCK_MONOTONIC time @deadline has passed.  Returns false, with the
+ * path marked closed, if we were asked to stop instead.
+ */
+static bool replay_wait(struct ss_session *s, struct path *path,
+			uint64_t deadline, uint64_t want, uint64_t *received)
+{
+	struct pollfd pfd[3] = { { .fd = path->fd, .events = POLLIN } };
+	struct timespec ts;
+
+	watch_stop(s, &pfd[1]);
+
+	while (1) {
+		uint64_t now = now_ns();
+
+		if (want ? (*received >= want) : (now >= deadline))
+			return true;
+
+		if (!want) {
+			ts.tv_sec = (deadline - now) / 1000000000ULL;
+			ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		}
+
+		if (ppoll(pfd, 3, want ? NULL : &ts, NULL) <= 0)
+			continue;
+		if (stop_wanted(s, &pfd[1])) {
+			path->closed = true;
+			return false;
+		}
+		if (pfd[0].revents)
+			replay_drain(s, path, received);
+	}
+}
+
+static bool replay_send(struct ss_session *s, struct path *path,
+			const char *buf, size_t len, uint64_t *received)
+{
+	struct pollfd pfd[3] = {
+		{ .fd = path->fd, .events = POLLIN | POLLOUT },
+	};
+
+	watch_stop(s, &pfd[1]);
+
+	while (len > 0) {
+		int ret = write(path->fd, buf, len);
+
+		if (ret > 0) {
+			buf += ret;
+			len -= ret;
+			continue;
+		} else if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+			perror("write");
+			return false;
+		}
+
+		if (ppoll(pfd, 3, NULL, NULL) <= 0)
+			continue;
+		if (stop_wanted(s, &pfd[1])) {
+			path->closed = true;
+			return false;
+		}
+		if (pfd[0].revents & POLLIN)
+			replay_drain(s, path, received);
+	}
+
+	return true;
+}
+
+/*
+ * Closing the master discards anything the client has not read yet, so
+ * let go of our hold on the slave and wait (for a while) for the client
+ * to close it.
+ */
+static void replay_linger(struct ss_session *s, struct path *path,
+			  uint64_t *received)
+{
+	struct pollfd pfd[3] = { { .fd = path->fd, .events = POLLIN } };
+	uint64_t deadline = now_ns() + 10 * 1000000000ULL;
+
+	close(path->hold_fd);
+	path->hold_fd = -1;
+	watch_stop(s, &pfd[1]);
+
+	while (now_ns() < deadline) {
+		if (poll(pfd, 3, 100) <= 0)
+			continue;
+		if (stop_wanted(s, &pfd[1]))
+			break;
+		if (pfd[0].revents & POLLHUP)
+			break;
+		replay_drain(s, path, received);
+	}
+}
+
+/*
+ * Play one side (replay_dir) of one pair of a capture into a pty, as if
+ * it were the device.  Chunks are paced to their recorded timing
+ * divided by replay_speed (0 means as fast as possible).  The clock
+ * starts at the first byte from the client if the recording starts
+ * with the other side talking.
+ *
+ * In lockstep mode each chunk is held back until the client has sent
+ * as many bytes as the other side had at that point of the recording,
+ * and only the recorded turnaround time is reproduced.
+ */
+static int replay(struct ss_session *s, const char *filename)
+{
+	struct cap_reader r;
+	const struct cap_rec *rec;
+	struct path path;
+	uint64_t expected = 0;
+	uint64_t received = 0;
+	uint64_t peer_ts = 0;
+	uint64_t origin = 0;
+	uint64_t origin_ts = 0;
+	uint64_t started;
+	unsigned long chunks = 0;
+	unsigned long long bytes = 0;
+	int ret = 0;
+
+	if (!cap_open(&r, filename))
+		return 1;
+
+	memset(&path, 0, sizeof(path));
+	path.fd = path.hold_fd = path.rawlog_fd = -1;
+	strcpy(path.name, "client");
+
+	if (!open_pty(s, &path)) {
+		cap_close(&r);
+		return 1;
+	}
+	fcntl(path.fd, F_SETFL, fcntl(path.fd, F_GETFL) | O_NONBLOCK);
+
+	started = now_ns();
+
+	while ((rec = cap_next(&r))) {
+		uint64_t ts = le64toh(rec->ts);
+		uint32_t len = le32toh(rec->len);
+		uint64_t due;
+
+		if (rec->pair != s->replay_pair)
+			continue;
+
+		if (rec->dir != s->replay_dir) {
+			expected += len;
+			peer_ts = ts;
+			if (!origin && !s->lockstep) {
+				if (!replay_wait(s, &path, 0, 1, &received))
+					break;
+				origin = now_ns();
+				origin_ts = ts;
+			}
+			continue;
+		}
+
+		if (s->lockstep && expected) {
+			if (!replay_wait(s, &path, 0, expected, &received))
+				break;
+			due = now_ns();
+			if (s->replay_speed > 0)
+				due += (ts - peer_ts) / s->replay_speed;
+		} else {
+			if (!origin) {
+				origin = now_ns();
+				origin_ts = ts;
+			}
+			due = origin;
+			if (s->replay_speed > 0)
+				due += (ts - origin_ts) / s->replay_speed;
+		}
+
+		if (!replay_wait(s, &path, due, 0, &received))
+			break;
+
+		if (!s->quiescent)
+			printf("%s %u:\n",
+			       s->replay_dir == CAP_DIR_A ? "A" : "B", len);
+		hexdump(s, (char *)(rec + 1), len, stdout);
+
+		if (!replay_send(s, &path, (char *)(rec + 1), len, &received)) {
+			if (!path.closed)
+				ret = 1;
+			break;
+		}
+
+		chunks++;
+		bytes += len;
+	}
+
+	if (!path.closed)
+		replay_linger(s, &path, &received);
+
+	printf("Replayed %lu chunks (%llu bytes) in %.3f s, received %llu\n",
+	       chunks, bytes, (now_ns() - started) / 1e9,
+	       (unsigned long long)received);
+
+	cap_close(&r);
+	close(path.fd);
+	if (path.hold_fd >= 0)
+		close(path.hold_fd);
+
+	return ret;
+}
+
+/*
+ * Radio emulation: answer a clone protocol from an image file on a pty,
+ * so drivers can be exercised (and timed) without hardware.  Input is
+ * read in bulk and parsed by a per-protocol state machine; responses
+ * are gathered and written in as few calls as the pty will take.
+ */
+#define CHIRP_IMG_MAGIC	"\x00\xff" "chirp\xee" "img\x00\x01"
+
+enum emu_proto {
+	EMU_BAOFENG,
+	EMU_ICOM,
+};
+
+enum bf_state {
+	BF_MAGIC,
+	BF_START,
+	BF_IDENT_ACK,
+	BF_CMD,
+};
+
+struct emu {
+	enum emu_proto proto;
+	unsigned char *mem;
+	size_t mem_size;
+	unsigned char *ident;
+	size_t ident_len;
+	bool dirty;
+
+	int state;
+	unsigned char frame[1024];
+	size_t flen;
+	size_t fneed;
+
+	struct outq out;
+
+	unsigned long blocks_read;
+	unsigned long blocks_written;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	uint64_t first;
+	uint64_t last;
+};
+
+static bool emu_load(struct ss_session *s, struct emu *emu,
+		     const char *filename)
+{
+	struct stat st;
+	unsigned char *data;
+	unsigned char *meta;
+	size_t len;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	fstat(fd, &st);
+	len = st.st_size;
+	data = malloc(len + 1);
+	if (!data || (read(fd, data, len) != (ssize_t)len)) {
+		perror(filename);
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	/* Images saved by CHIRP carry a metadata blob at the end */
+	meta = memmem(data, len, CHIRP_IMG_MAGIC, sizeof(CHIRP_IMG_MAGIC) - 1);
+	if (meta)
+		len = meta - data;
+
+	emu->mem = data;
+	if (emu->proto == EMU_BAOFENG) {
+		/* Baofeng images are the memory followed by the ident */
+		if (len < s->mem_size) {
+			fprintf(stderr, "%s: shorter than memory size 0x%zx\n",
+				filename, s->mem_size);
+			return false;
+		}
+		emu->mem_size = s->mem_size;
+		emu->ident = data + s->mem_size;
+		emu->ident_len = len - s->mem_size;
+	} else {
+		emu->mem_size = len;
+	}
+
+	return true;
+}
+
+static bool emu_save(struct emu *emu, const char *filename)
+{
+	int fd;
+	size_t len = emu->mem_size + emu->ident_len;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(filename);
+		return false;
+	}
+
+	if (write(fd, emu->mem, len) != (ssize_t)len)
+		perror(filename);
+	close(fd);
+
+	return true;
+}
+
+static const unsigned char ack = 0x06;
+
+/*
+ * Baofeng: magic, ACK, 0x02, ident, ACK/ACK, then "S" addr len read
+ * requests (answered with "X" addr len data) and "X" addr len data
+ * writes (answered with ACK), as in baofeng_common.py.
+ */
+static void emu_baofeng(struct ss_session *s, struct emu *emu,
+			const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		switch (emu->state) {
+		case BF_MAGIC:
+			emu->frame[emu->flen++] = c;
+			if (emu->flen == (size_t)s->magic_len) {
+				outq_append(&emu->out, &ack, 1);
+				emu->state = BF_START;
+				emu->flen = 0;
+			}
+			break;
+		case BF_START:
+			if (c == 0x02) {
+				outq_append(&emu->out, emu->ident,
+					    emu->ident_len);
+				emu->state = BF_IDENT_ACK;
+			}
+			break;
+		case BF_IDENT_ACK:
+			if (c == 0x06) {
+				outq_append(&emu->out, &ack, 1);
+				emu->state = BF_CMD;
+			}
+			break;
+		case BF_CMD:
+			if ((emu->flen == 0) && (c != 'S') && (c != 'X')) {
+				/* ACKs from the PC, or the start of a retry */
+				if (c != 0x06) {
+					emu->state = BF_MAGIC;
+					emu->frame[emu->flen++] = c;
+				}
+				break;
+			}
+
+			if (emu->flen < 4) {
+				emu->frame[emu->flen++] = c;
+				if (emu->flen < 4)
+					break;
+				emu->fneed = 4;
+				if (emu->frame[0] == 'X')
+					emu->fneed += emu->frame[3];
+				if (emu->flen < emu->fneed)
+					break;
+			} else {
+				/* Copy as much of the write payload as we can */
+				size_t n = emu->fneed - emu->flen;
+
+				if (n > len - i)
+					n = len - i;
+				memcpy(emu->frame + emu->flen, buf + i, n);
+				emu->flen += n;
+				i += n - 1;
+				if (emu->flen < emu->fneed)
+					break;
+			}
+
+			{
+				unsigned int addr = (emu->frame[1] << 8) |
+					emu->frame[2];
+				unsigned int size = emu->frame[3];
+
+				if (addr + size > emu->mem_size)
+					size = addr > emu->mem_size ?
+						0 : emu->mem_size - addr;
+
+				if (emu->frame[0] == 'S') {
+					unsigned char hdr[4] = {
+						'X', addr >> 8, addr & 0xFF,
+						emu->frame[3] };
+
+					unsigned char fill[256];
+
+					/* Past the end reads back as 0xFF */
+					memset(fill, 0xFF, sizeof(fill));
+
+					if (s->ack_block)
+						outq_append(&emu->out, &ack, 1);
+					outq_append(&emu->out, hdr, 4);
+					outq_append(&emu->out, emu->mem + addr,
+						    size);
+					outq_append(&emu->out, fill,
+						    emu->frame[3] - size);
+					emu->blocks_read++;
+				} else {
+					memcpy(emu->mem + addr, emu->frame + 4,
+					       size);
+					outq_append(&emu->out, &ack, 1);
+					emu->dirty = true;
+					emu->blocks_written++;
+				}
+			}
+			emu->flen = 0;
+			break;
+		}
+	}
+}
+
+static void icom_frame(struct emu *emu, unsigned char cmd,
+		       const unsigned char *payload, size_t len)
+{
+	static const unsigned char hdr[4] = { 0xFE, 0xFE, 0xEF, 0xEE };
+	static const unsigned char end = 0xFD;
+
+	outq_append(&emu->out, hdr, sizeof(hdr));
+	outq_append(&emu->out, &cmd, 1);
+	outq_append(&emu->out, payload, len);
+	outq_append(&emu->out, &end, 1);
+}
+
+static unsigned char icom_checksum(const unsigned char *data, size_t len)
+{
+	unsigned int cs = 0;
+
+	while (len--)
+		cs += *data++;
+
+	return ((cs ^ 0xFFFF) + 1) & 0xFF;
+}
+
+/* Clone out: the whole memory as BCD-encoded E4 frames, then E5 */
+static void icom_clone_out(struct emu *emu)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	bool wide = emu->mem_size >= 0x10000;
+	unsigned char raw[4 + 1 + 32 + 1];
+	unsigned char bcd[2 * sizeof(raw)];
+	size_t addr;
+
+	for (addr = 0; addr < emu->mem_size; addr += 32) {
+		size_t n = emu->mem_size - addr < 32 ? emu->mem_size - addr : 32;
+		size_t off = 0;
+		size_t i;
+
+		if (wide) {
+			raw[off++] = addr >> 24;
+			raw[off++] = addr >> 16;
+		}
+		raw[off++] = addr >> 8;
+		raw[off++] = addr & 0xFF;
+		raw[off++] = n;
+		memcpy(raw + off, emu->mem + addr, n);
+		off += n;
+		raw[off] = icom_checksum(raw, off);
+		off++;
+
+		for (i = 0; i < off; i++) {
+			bcd[2 * i] = digits[raw[i] >> 4];
+			bcd[2 * i + 1] = digits[raw[i] & 0xF];
+		}
+
+		icom_frame(emu, 0xE4, bcd, 2 * off);
+		emu->blocks_read++;
+	}
+
+	icom_frame(emu, 0xE5, (const unsigned char *)"Icom Inc.", 9);
+}
+
+static int unhex(unsigned char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* Parse a string of hex digits into @out; returns the number of bytes */
+static int parse_hex(const char *str, char *out, int max)
+{
+	int n = 0;
+
+	while (str[0] && str[1] && (n < max)) {
+		int hi = unhex(str[0]);
+		int lo = unhex(str[1]);
+
+		if ((hi < 0) || (lo < 0))
+			return -1;
+		out[n++] = (hi << 4) | lo;
+		str += 2;
+	}
+
+	return n;
+}
+
+/* Clone in: decode one BCD-encoded E4 frame into memory */
+static void icom_clone_dat(struct emu *emu, const unsigned char *payload,
+			   size_t len)
+{
+	unsigned char raw[512];
+	size_t n = 0;
+	size_t hdr = emu->mem_size >= 0x10000 ? 5 : 3;
+	size_t addr = 0;
+	size_t size;
+	size_t i;
+
+	for (i = 0; (i + 1 < len) && (n < sizeof(raw)); i += 2) {
+		int hi = unhex(payload[i]);
+		int lo = unhex(payload[i + 1]);
+
+		if ((hi < 0) || (lo < 0))
+			return;
+		raw[n++] = (hi << 4) | lo;
+	}
+
+	if (n < hdr + 1)
+		return;
+
+	for (i = 0; i < hdr - 1; i++)
+		addr = (addr << 8) | raw[i];
+	size = raw[hdr - 1];
+
+	if ((hdr + size + 1 > n) ||
+	    (icom_checksum(raw, hdr + size) != raw[hdr + size]) ||
+	    (addr + size > emu->mem_size)) {
+		printf("Bad clone data frame at 0x%04zx\n", addr);
+		return;
+	}
+
+	memcpy(emu->mem + addr, raw + hdr, size);
+	emu->dirty = true;
+	emu->blocks_written++;
+}
+
+/*
+ * Icom: 0xFE 0xFE src dst cmd payload 0xFD frames, as understood by
+ * parse_frame_generic() in icf.py.  Only BCD (non-raw) clone data is
+ * supported.
+ */
+static void emu_icom(struct ss_session *s, struct emu *emu,
+		     const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		const unsigned char *end = memchr(buf, 0xFD, len);
+		size_t n = end ? (size_t)(end - buf) + 1 : len;
+		unsigned char *f;
+		size_t flen;
+
+		if (emu->flen + n > sizeof(emu->frame)) {
+			/* Garbage; resynchronise on the next frame */
+			emu->flen = 0;
+			buf += n;
+			len -= n;
+			continue;
+		}
+
+		memcpy(emu->frame + emu->flen, buf, n);
+		emu->flen += n;
+		buf += n;
+		len -= n;
+		if (!end)
+			break;
+
+		/* Skip the preamble (hispeed mode sends a lot of it) */
+		f = emu->frame;
+		flen = emu->flen;
+		while ((flen > 0) && (*f == 0xFE)) {
+			f++;
+			flen--;
+		}
+		emu->flen = 0;
+
+		/* src dst cmd ... 0xFD */
+		if ((flen < 4) || (f[0] != 0xEE))
+			continue;
+
+		switch (f[2]) {
+		case 0xE0:
+			icom_frame(emu, 0xE1, (unsigned char *)s->icom_model,
+				   sizeof(s->icom_model));
+			break;
+		case 0xE2:
+			icom_clone_out(emu);
+			break;
+		case 0xE4:
+			icom_clone_dat(emu, f + 3, flen - 4);
+			break;
+		case 0xE5:
+			icom_frame(emu, 0xE6, (const unsigned char *)"\x00", 1);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void emu_report(struct ss_session *s, struct emu *emu)
+{
+	double secs = (emu->last - emu->first) / 1e9;
+
+	printf("Session: %lu blocks read, %lu written, %llu bytes in, "
+	       "%llu out, %.3f s",
+	       emu->blocks_read, emu->blocks_written,
+	       emu->bytes_in, emu->bytes_out, secs);
+	if (secs > 0)
+		printf(" (%.0f bytes/s)",
+		       (emu->bytes_in + emu->bytes_out) / secs);
+	printf("\n");
+	fflush(stdout);
+
+	if (emu->dirty && s->save_file && emu_save(emu, s->save_file))
+		printf("Saved image to %s\n", s->save_file);
+
+	emu->blocks_read = emu->blocks_written = 0;
+	emu->bytes_in = emu->bytes_out = 0;
+	emu->first = 0;
+	emu->state = 0;
+	emu->flen = 0;
+	emu->out.len = 0;
+}
+
+/*
+ * Serve clone sessions from the image on a pty until stopped.  We hold
+ * the slave open until a client starts talking, then let go so that we
+ * see a hangup (and report the session) when the client closes it.
+ */
+static int emulate_radio(struct ss_session *s)
+{
+	struct emu emu;
+	struct path path;
+	struct path client;
+	struct pollfd pfd[3];
+	unsigned char buf[CHUNK_SIZE];
+
+	memset(&emu, 0, sizeof(emu));
+	if (STREQ(s->emulate, "baofeng")) {
+		emu.proto = EMU_BAOFENG;
+	} else if (STREQ(s->emulate, "icom")) {
+		emu.proto = EMU_ICOM;
+	} else {
+		fprintf(stderr, "Unknown protocol '%s'\n", s->emulate);
+		return 1;
+	}
+
+	if (!s->image_file) {
+		fprintf(stderr, "--emulate needs an --image\n");
+		return 1;
+	}
+
+	if (!emu_load(s, &emu, s->image_file))
+		return 1;
+
+	memset(&path, 0, sizeof(path));
+	path.fd = path.hold_fd = path.rawlog_fd = -1;
+	strcpy(path.name, "radio");
+	path.dir = CAP_DIR_B;
+
+	/* Only used to tag what the client sent in the capture */
+	memset(&client, 0, sizeof(client));
+	strcpy(client.name, "client");
+	client.dir = CAP_DIR_A;
+
+	if (!open_pty(s, &path))
+		return 1;
+	fcntl(path.fd, F_SETFL, fcntl(path.fd, F_GETFL) | O_NONBLOCK);
+
+	pfd[0].fd = path.fd;
+	watch_stop(s, &pfd[1]);
+
+	while (1) {
+		int ret;
+
+		pfd[0].events = POLLIN | (emu.out.len ? POLLOUT : 0);
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		if (stop_wanted(s, &pfd[1]))
+			break;
+
+		if (pfd[0].revents & POLLOUT) {
+			ret = write(path.fd, emu.out.buf, emu.out.len);
+			if (ret > 0) {
+				capture_data(s, &path, stamp_ns(), emu.out.buf,
+					     ret);
+				memmove(emu.out.buf, emu.out.buf + ret,
+					emu.out.len - ret);
+				emu.out.len -= ret;
+				emu.bytes_out += ret;
+			}
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			ret = read(path.fd, buf, sizeof(buf));
+			if (ret > 0) {
+				if (path.hold_fd >= 0) {
+					close(path.hold_fd);
+					path.hold_fd = -1;
+				}
+				emu.last = stamp_ns();
+				if (!emu.first)
+					emu.first = emu.last;
+				emu.bytes_in += ret;
+				capture_data(s, &client, emu.last, (char *)buf,
+					     ret);
+
+				if (emu.proto == EMU_BAOFENG)
+					emu_baofeng(s, &emu, buf, ret);
+				else
+					emu_icom(s, &emu, buf, ret);
+
+				/* Try to send the answer right away */
+				pfd[0].revents = POLLOUT;
+				continue;
+			}
+		}
+
+		if ((pfd[0].revents & POLLHUP) && (path.hold_fd < 0)) {
+			emu_report(s, &emu);
+			record_flush(s);
+			path.hold_fd = open(path.path, O_RDWR | O_NOCTTY);
+		}
+	}
+
+	if (emu.first)
+		emu_report(s, &emu);
+	close(path.fd);
+	if (path.hold_fd >= 0)
+		close(path.hold_fd);
+	free(emu.out.buf);
+
+	return 0;
+}
+
+static bool open_serial(const char *serpath, struct path *path)
+{
+	path->fd = open(serpath, O_RDWR);
+	if (path->fd < 0)
+		perror(serpath);
+
+	strncpy(path->path, serpath, sizeof(path->path));
+
+	return path->fd >= 0;
+}
+
+static bool open_socket(const char *spec, struct path *path)
+{
+	int lfd;
+	struct sockaddr_in srv;
+	struct sockaddr_in cli;
+	unsigned int cli_len = sizeof(cli);
+
+	if (!parse_addr(spec, &srv, 2000))
+		return false;
+
+	lfd = listen_on(&srv, 1);
+	if (lfd < 0)
+		return false;
+
+	printf("Waiting on %s:%i...\n",
+	       inet_ntoa(srv.sin_addr), ntohs(srv.sin_port));
+
+	path->fd = accept(lfd, (struct sockaddr *)&cli, &cli_len);
+	close(lfd);
+	if (path->fd < 0) {
+		perror("accept");
+		return false;
+	}
+
+	printf("Accepted socket client %s:%i\n",
+	       inet_ntoa(cli.sin_addr), ntohs(cli.sin_port));
+
+	strcpy(path->path, "SOCKET");
+
+	return true;
+}
+
+static bool open_path(struct ss_session *s, const char *opt, struct path *path)
+{
+	if (STREQ(opt, "pty"))
+		return open_pty(s, path);
+	else if (STREQ(opt, "listen"))
+		return open_socket(NULL, path);
+	else if (strncmp(opt, "listen:", 7) == 0)
+		return open_socket(opt + 7, path);
+	else
+		return open_serial(opt, path);
+}
+
+#ifdef __linux__
+/*
+ * glibc's struct termios cannot express arbitrary rates, and its
+ * headers clash with <asm/termbits.h>, so declare the kernel's
+ * termios2 here for the TCGETS2/TCSETS2 ioctls.
+ */
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER		0010000
+#endif
+#endif
+
+static const struct {
+	unsigned int rate;
+	speed_t speed;
+} baud_rates[] = {
+	{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 },
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+	{ 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+	{ 460800, B460800 }, { 921600, B921600 },
+#endif
+};
+
+static bool set_custom_baud(struct path *path, unsigned int rate)
+{
+#ifdef __linux__
+	struct termios2 t2;
+
+	if (ioctl(path->fd, TCGETS2, &t2) < 0) {
+		perror("TCGETS2");
+		return false;
+	}
+
+	t2.c_cflag &= ~CBAUD;
+	t2.c_cflag |= BOTHER;
+	t2.c_ispeed = rate;
+	t2.c_ospeed = rate;
+
+	if (ioctl(path->fd, TCSETS2, &t2) < 0) {
+		perror("TCSETS2");
+		return false;
+	}
+
+	return true;
+#else
+	fprintf(stderr, "%s: unsupported baud rate %u\n", path->name, rate);
+	return false;
+#endif
+}
+
+static bool set_low_latency(struct path *path)
+{
+#ifdef __linux__
+	struct serial_struct ser;
+
+	if (ioctl(path->fd, TIOCGSERIAL, &ser) < 0)
+		return false;
+
+	ser.flags |= ASYNC_LOW_LATENCY;
+
+	return ioctl(path->fd, TIOCSSERIAL, &ser) == 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Apply a --ttyA/--ttyB spec: a comma separated list of a baud rate
+ * (any rate the driver supports, via BOTHER if it is not a standard
+ * one), a data/parity/stop setting like 8N1, "raw", "vmin=N",
+ * "vtime=N" and "lowlatency".  The original settings are kept so they
+ * can be restored.
+ */
+static bool setup_tty(struct path *path)
+{
+	struct termios t;
+	unsigned int custom = 0;
+	bool low_latency = false;
+	char *spec;
+	char *tok;
+	char *save;
+	size_t i;
+
+	if (tcgetattr(path->fd, &t) < 0) {
+		perror(path->name);
+		return false;
+	}
+
+	path->saved_tios = t;
+	path->tios_saved = true;
+
+	/* Raw mode resets the character size, so it has to go first */
+	spec = strdup(path->tty_spec);
+	for (tok = strtok_r(spec, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save))
+		if (STREQ(tok, "raw"))
+			cfmakeraw(&t);
+	free(spec);
+
+	t.c_cflag |= CLOCAL | CREAD;
+
+	spec = strdup(path->tty_spec);
+	for (tok = strtok_r(spec, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (isdigit(tok[0]) && (strlen(tok) == 3) &&
+		    strchr("NEOneo", tok[1]) && strchr("12", tok[2])) {
+			t.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB);
+			switch (tok[0]) {
+			case '5': t.c_cflag |= CS5; break;
+			case '6': t.c_cflag |= CS6; break;
+			case '7': t.c_cflag |= CS7; break;
+			default: t.c_cflag |= CS8; break;
+			}
+			if (toupper(tok[1]) == 'E')
+				t.c_cflag |= PARENB;
+			else if (toupper(tok[1]) == 'O')
+				t.c_cflag |= PARENB | PARODD;
+			if (tok[2] == '2')
+				t.c_cflag |= CSTOPB;
+		} else if (isdigit(tok[0])) {
+			unsigned int rate = strtoul(tok, NULL, 10);
+
+			custom = rate;
+			for (i = 0; i < sizeof(baud_rates) / sizeof(*baud_rates);
+			     i++) {
+				if (baud_rates[i].rate == rate) {
+					cfsetispeed(&t, baud_rates[i].speed);
+					cfsetospeed(&t, baud_rates[i].speed);
+					custom = 0;
+					break;
+				}
+			}
+		} else if (STREQ(tok, "raw")) {
+			continue;
+		} else if (strncmp(tok, "vmin=", 5) == 0) {
+			t.c_cc[VMIN] = atoi(tok + 5);
+		} else if (strncmp(tok, "vtime=", 6) == 0) {
+			t.c_cc[VTIME] = atoi(tok + 6);
+		} else if (STREQ(tok, "lowlatency")) {
+			low_latency = true;
+		} else {
+			fprintf(stderr, "%s: unknown tty setting '%s'\n",
+				path->name, tok);
+			free(spec);
+			return false;
+		}
+	}
+	free(spec);
+
+	if (tcsetattr(path->fd, TCSANOW, &t) < 0) {
+		perror(path->name);
+		return false;
+	}
+
+	if (custom && !set_custom_baud(path, custom))
+		return false;
+
+	if (low_latency && !set_low_latency(path))
+		fprintf(stderr, "%s: low latency mode not supported\n",
+			path->name);
+
+	return true;
+}
+
+static void restore_tty(struct path *path)
+{
+	if (path->tios_saved)
+		tcsetattr(path->fd, TCSANOW, &path->saved_tios);
+}
+
+static bool open_log(const char *filename, struct path *path)
+{
+	path->rawlog_fd = open(filename, O_WRONLY | O_CREAT, 0644);
+	if (path->rawlog_fd < 0)
+		perror(filename);
+	path->log_name = strdup(filename);
+	path->log_opened = now_ns();
+
+	return path->rawlog_fd >= 0;
+}
+
+/*
+ * Return the pair that an option touching @field should apply to.  A
+ * field that has already been set on the current pair (e.g. a second
+ * -A) begins a new pair, so "-A x -B y -A z -B w" proxies two links.
+ */
+static void init_path(struct path *path)
+{
+	path->fd = path->hold_fd = path->rawlog_fd = path->timer_fd = -1;
+	path->fwd_pipe[0] = path->fwd_pipe[1] = -1;
+	path->log_pipe[0] = path->log_pipe[1] = -1;
+	path->tap_pipe[0] = path->tap_pipe[1] = -1;
+	path->cap_pipe[0] = path->cap_pipe[1] = -1;
+}
+
+static struct pair *pair_for(struct ss_session *s, unsigned int field)
+{
+	struct pair *pair;
+
+	if ((s->npairs > 0) && !(s->pairs[s->npairs - 1].set & field))
+		goto found;
+
+	s->pairs = realloc(s->pairs, (s->npairs + 1) * sizeof(*s->pairs));
+	if (!s->pairs) {
+		perror("realloc");
+		exit(1);
+	}
+
+	pair = &s->pairs[s->npairs];
+	memset(pair, 0, sizeof(*pair));
+	init_path(&pair->A);
+	init_path(&pair->B);
+	if (s->npairs == 0) {
+		strcpy(pair->A.name, "A");
+		strcpy(pair->B.name, "B");
+	} else {
+		sprintf(pair->A.name, "A%i", s->npairs);
+		sprintf(pair->B.name, "B%i", s->npairs);
+	}
+	s->npairs++;
+
+ found:
+	pair = &s->pairs[s->npairs - 1];
+	pair->set |= field;
+
+	return pair;
+}
+
+/*
+ * Create @count pairs whose ends are both ptys, for clients that only
+ * want to talk to each other through us.  Every pair costs six
+ * descriptors, so make sure we are allowed as many as we can get.
+ */
+static bool open_vpairs(struct ss_session *s, int count)
+{
+	struct rlimit rl;
+	struct pair *pair;
+	int i;
+
+	if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) &&
+	    (rl.rlim_cur < rl.rlim_max)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	for (i = 0; i < count; i++) {
+		pair = pair_for(s, PAIR_A | PAIR_B);
+		if (!open_pty(s, &pair->A) || !open_pty(s, &pair->B))
+			return false;
+	}
+
+	return true;
+}
+
+/* A byte count with an optional k, M or G suffix */
+static uint64_t parse_size(const char *str)
+{
+	char *end;
+	uint64_t size = strtoull(str, &end, 0);
+
+	if ((*end == 'k') || (*end == 'K'))
+		size <<= 10;
+	else if (*end == 'M')
+		size <<= 20;
+	else if (*end == 'G')
+		size <<= 30;
+
+	return size;
+}
+
+enum {
+	OPT_PATHA,
+	OPT_PATHB,
+	OPT_LOGA,
+	OPT_LOGB,
+	OPT_NAMEA,
+	OPT_NAMEB,
+	OPT_TTYA,
+	OPT_TTYB,
+	OPT_VPAIRS,
+	OPT_STATE_FILE,
+	OPT_FAULTA,
+	OPT_FAULTB,
+	OPT_OBSERVE,
+	OPT_OBSERVE_QUEUE,
+	OPT_DECODE,
+	OPT_STATS,
+	OPT_STATS_FILE,
+	OPT_ROTATE_SIZE,
+	OPT_ROTATE_TIME,
+	OPT_COMPRESS,
+	OPT_TRIGGER,
+	OPT_PRE_TRIGGER,
+	OPT_POST_TRIGGER,
+	OPT_TRIGGER_BUFFER,
+	OPT_QUIESCENT,
+	OPT_DIGITS,
+	OPT_WINDOW,
+	OPT_SPLICE,
+	OPT_URING,
+	OPT_RING,
+	OPT_TIMESTAMPS,
+	OPT_CAPTURE,
+	OPT_READ,
+	OPT_FROM,
+	OPT_TO,
+	OPT_ANALYZE,
+	OPT_SESSION_GAP,
+	OPT_IDLE_GAP,
+	OPT_COMPARE,
+	OPT_COMPARE_DIR,
+	OPT_COMPARE_PAIR,
+	OPT_COMPARE_SLACK,
+	OPT_PCAPNG,
+	OPT_LINKTYPE,
+	OPT_REPLAY,
+	OPT_REPLAY_DIR,
+	OPT_REPLAY_PAIR,
+	OPT_SPEED,
+	OPT_LOCKSTEP,
+	OPT_EMULATE,
+	OPT_IMAGE,
+	OPT_SAVE,
+	OPT_MEM_SIZE,
+	OPT_ACK_BLOCK,
+	OPT_MAGIC_LEN,
+	OPT_MODEL,
+	OPT_MAX
+};
+
+static const struct ss_option options[] = {
+	[OPT_PATHA] = { "pathA", SS_ARG_REQUIRED, 'A' },
+	[OPT_PATHB] = { "pathB", SS_ARG_REQUIRED, 'B' },
+	[OPT_LOGA] = { "logA", SS_ARG_REQUIRED, 0 },
+	[OPT_LOGB] = { "logB", SS_ARG_REQUIRED, 0 },
+	[OPT_NAMEA] = { "nameA", SS_ARG_REQUIRED, 0 },
+	[OPT_NAMEB] = { "nameB", SS_ARG_REQUIRED, 0 },
+	[OPT_TTYA] = { "ttyA", SS_ARG_REQUIRED, 0 },
+	[OPT_TTYB] = { "ttyB", SS_ARG_REQUIRED, 0 },
+	[OPT_VPAIRS] = { "vpairs", SS_ARG_REQUIRED, 0 },
+	[OPT_STATE_FILE] = { "state-file", SS_ARG_REQUIRED, 0 },
+	[OPT_FAULTA] = { "faultA", SS_ARG_REQUIRED, 0 },
+	[OPT_FAULTB] = { "faultB", SS_ARG_REQUIRED, 0 },
+	[OPT_OBSERVE] = { "observe", SS_ARG_REQUIRED, 0 },
+	[OPT_OBSERVE_QUEUE] = { "observe-queue", SS_ARG_REQUIRED, 0 },
+	[OPT_DECODE] = { "decode", SS_ARG_REQUIRED, 0 },
+	[OPT_STATS] = { "stats", SS_ARG_REQUIRED, 0 },
+	[OPT_STATS_FILE] = { "stats-file", SS_ARG_REQUIRED, 0 },
+	[OPT_ROTATE_SIZE] = { "rotate-size", SS_ARG_REQUIRED, 0 },
+	[OPT_ROTATE_TIME] = { "rotate-time", SS_ARG_REQUIRED, 0 },
+	[OPT_COMPRESS] = { "compress", SS_ARG_REQUIRED, 0 },
+	[OPT_TRIGGER] = { "trigger", SS_ARG_REQUIRED, 0 },
+	[OPT_PRE_TRIGGER] = { "pre-trigger", SS_ARG_REQUIRED, 0 },
+	[OPT_POST_TRIGGER] = { "post-trigger", SS_ARG_REQUIRED, 0 },
+	[OPT_TRIGGER_BUFFER] = { "trigger-buffer", SS_ARG_REQUIRED, 0 },
+	[OPT_QUIESCENT] = { "quiescent", SS_ARG_NONE, 'q' },
+	[OPT_DIGITS] = { "digits", SS_ARG_REQUIRED, 'd' },
+	[OPT_WINDOW] = { "window", SS_ARG_REQUIRED, 0 },
+	[OPT_SPLICE] = { "splice", SS_ARG_OPTIONAL, 0 },
+	[OPT_URING] = { "uring", SS_ARG_OPTIONAL, 0 },
+	[OPT_RING] = { "ring", SS_ARG_REQUIRED, 0 },
+	[OPT_TIMESTAMPS] = { "timestamps", SS_ARG_NONE, 't' },
+	[OPT_CAPTURE] = { "capture", SS_ARG_REQUIRED, 0 },
+	[OPT_READ] = { "read", SS_ARG_REQUIRED, 0 },
+	[OPT_FROM] = { "from", SS_ARG_REQUIRED, 0 },
+	[OPT_TO] = { "to", SS_ARG_REQUIRED, 0 },
+	[OPT_ANALYZE] = { "analyze", SS_ARG_REQUIRED, 0 },
+	[OPT_SESSION_GAP] = { "session-gap", SS_ARG_REQUIRED, 0 },
+	[OPT_IDLE_GAP] = { "idle-gap", SS_ARG_REQUIRED, 0 },
+	[OPT_COMPARE] = { "compare", SS_ARG_REQUIRED, 0 },
+	[OPT_COMPARE_DIR] = { "compare-dir", SS_ARG_REQUIRED, 0 },
+	[OPT_COMPARE_PAIR] = { "compare-pair", SS_ARG_REQUIRED, 0 },
+	[OPT_COMPARE_SLACK] = { "compare-slack", SS_ARG_REQUIRED, 0 },
+	[OPT_PCAPNG] = { "pcapng", SS_ARG_REQUIRED, 0 },
+	[OPT_LINKTYPE] = { "linktype", SS_ARG_REQUIRED, 0 },
+	[OPT_REPLAY] = { "replay", SS_ARG_REQUIRED, 0 },
+	[OPT_REPLAY_DIR] = { "replay-dir", SS_ARG_REQUIRED, 0 },
+	[OPT_REPLAY_PAIR] = { "replay-pair", SS_ARG_REQUIRED, 0 },
+	[OPT_SPEED] = { "speed", SS_ARG_REQUIRED, 0 },
+	[OPT_LOCKSTEP] = { "lockstep", SS_ARG_NONE, 0 },
+	[OPT_EMULATE] = { "emulate", SS_ARG_REQUIRED, 0 },
+	[OPT_IMAGE] = { "image", SS_ARG_REQUIRED, 0 },
+	[OPT_SAVE] = { "save", SS_ARG_REQUIRED, 0 },
+	[OPT_MEM_SIZE] = { "mem-size", SS_ARG_REQUIRED, 0 },
+	[OPT_ACK_BLOCK] = { "ack-block", SS_ARG_REQUIRED, 0 },
+	[OPT_MAGIC_LEN] = { "magic-len", SS_ARG_REQUIRED, 0 },
+	[OPT_MODEL] = { "model", SS_ARG_REQUIRED, 0 },
+	[OPT_MAX] = { NULL, 0, 0 },
+};
+
+const char *ss_version(void)
+{
+	return version;
+}
+
+const struct ss_option *ss_options(void)
+{
+	return options;
+}
+
+/*
+ * Put every setting back to its default and release anything the
+ * session holds.  This is the one place the defaults live.
+ */
+static void reset_engine(struct ss_session *s)
+{
+	static const char default_model[4] = { 0x20, 0x88, 0x00, 0x01 };
+	struct trigger *t;
+
+	s->quiescent = 0;
+	s->total_hex = 20;
+	s->window_ms = 50;
+	s->use_splice = false;
+	s->splice_sample = 64;
+	s->uring_entries = 0;
+	s->timestamps = false;
+	s->ring_size = 1024 * 1024;
+	free(s->read_file);
+	s->read_file = NULL;
+	s->read_from = 0;
+	s->read_to = -1;
+	free(s->analyze_file);
+	s->analyze_file = NULL;
+	s->session_gap_ns = 2000000000ULL;
+	s->idle_gap_ns = 100000000ULL;
+	free(s->compare_file);
+	s->compare_file = NULL;
+	s->compare_dir = CAP_DIR_A;	/* What the client sends */
+	s->compare_pair = 0;
+	s->compare_slack_ns = 500000000ULL;
+	free(s->replay_file);
+	s->replay_file = NULL;
+	s->replay_speed = 1.0;
+	s->replay_dir = CAP_DIR_B;		/* Play the radio's side */
+	s->replay_pair = 0;
+	s->lockstep = false;
+	free(s->emulate);
+	s->emulate = NULL;
+	free(s->image_file);
+	s->image_file = NULL;
+	free(s->save_file);
+	s->save_file = NULL;
+	s->mem_size = 0x2000;
+	s->ack_block = true;
+	s->magic_len = 7;
+	memcpy(s->icom_model, default_model, sizeof(s->icom_model));
+	s->decode = NULL;
+	s->stats_interval = 0;
+	free(s->stats_file);
+	s->stats_file = NULL;
+	s->rotate_size = 0;
+	s->rotate_secs = 0;
+	free((char *)s->compressor);
+	s->compressor = NULL;
+	free(s->state_file);
+	s->state_file = NULL;
+
+	if (s->capture.fd >= 0)
+		close(s->capture.fd);
+	free(s->capture.buf);
+	memset(&s->capture, 0, sizeof(s->capture));
+	s->capture.fd = -1;
+
+	if (s->pcapng.fd >= 0)
+		close(s->pcapng.fd);
+	free(s->pcapng.buf);
+	memset(&s->pcapng, 0, sizeof(s->pcapng));
+	s->pcapng.fd = -1;
+	s->pcapng_linktype = 147;		/* LINKTYPE_USER0 */
+
+	if (s->tick_fd >= 0)
+		close(s->tick_fd);
+	s->tick_fd = -1;
+	if (s->signal_fd >= 0)
+		close(s->signal_fd);
+	s->signal_fd = -1;
+
+	while (s->observe.clients)
+		observer_close(s, s->observe.clients);
+	if (s->observe.fd >= 0)
+		close(s->observe.fd);
+	memset(&s->observe, 0, sizeof(s->observe));
+	s->observe.fd = -1;
+	s->observe.qmax = 256 * 1024;
+
+	while ((t = s->filter.triggers)) {
+		s->filter.triggers = t->next;
+		free(t->spec);
+		free(t->tails);
+		free(t);
+	}
+	free(s->filter.buf);
+	memset(&s->filter, 0, sizeof(s->filter));
+	s->filter.pre_ns = 1000000000ULL;
+	s->filter.post_ns = 1000000000ULL;
+	s->filter.size = 1024 * 1024;
+
+	s->rotator.head = NULL;
+	s->rotator.tail = &s->rotator.head;
+	s->rotator.stop = false;
+	s->rotator.running = false;
+}
+
+struct ss_session *ss_session_new(void)
+{
+	struct ss_session *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->stop_fd < 0) {
+		perror("eventfd");
+		free(s);
+		return NULL;
+	}
+	s->stop_src.type = SRC_STOP;
+	s->tick_src.type = SRC_TICK;
+	s->signal_src.type = SRC_SIGNAL;
+	s->capture.fd = s->pcapng.fd = s->observe.fd = -1;
+	s->tick_fd = s->signal_fd = s->uring.fd = -1;
+	pthread_mutex_init(&s->rotator.lock, NULL);
+	pthread_cond_init(&s->rotator.cond, NULL);
+
+	reset_engine(s);
+
+	return s;
+}
+
+static void close_path(struct path *path)
+{
+	unwatch_path(path);
+	if (path->fd >= 0)
+		close(path->fd);
+	if (path->hold_fd >= 0)
+		close(path->hold_fd);
+	if (path->rawlog_fd >= 0)
+		close(path->rawlog_fd);
+	free(path->dec);
+	free(path->out.buf);
+	free(path->sending.buf);
+	free(path->logging.buf);
+	free(path->log_out.buf);
+	free(path->ubuf);
+	free_fault(path->fault);
+}
+
+void ss_session_free(struct ss_session *s)
+{
+	int i;
+
+	if (!s)
+		return;
+
+	for (i = 0; i < s->npairs; i++) {
+		close_path(&s->pairs[i].A);
+		close_path(&s->pairs[i].B);
+	}
+	free(s->pairs);
+	s->pairs = NULL;
+	s->npairs = 0;
+
+	reset_engine(s);
+	close(s->stop_fd);
+	free(s->hex);
+	free(s->hex_out);
+	pthread_mutex_destroy(&s->rotator.lock);
+	pthread_cond_destroy(&s->rotator.cond);
+	free(s);
+}
+
+int ss_set_option(struct ss_session *s, const char *name, const char *value)
+{
+	int opt;
+
+	for (opt = 0; opt < OPT_MAX; opt++)
+		if (STREQ(options[opt].name, name))
+			break;
+
+	if ((opt < OPT_MAX) && (options[opt].has_arg == SS_ARG_REQUIRED) &&
+	    !value)
+		return -1;
+
+	switch (opt) {
+	case OPT_PATHA:
+		if (!open_path(s, value, &pair_for(s, PAIR_A)->A))
+			return 1;
+		break;
+
+	case OPT_PATHB:
+		if (!open_path(s, value, &pair_for(s, PAIR_B)->B))
+			return 2;
+		break;
+
+	case OPT_LOGA:
+		if (!open_log(value, &pair_for(s, PAIR_LOGA)->A))
+			return 3;
+		break;
+
+	case OPT_LOGB:
+		if (!open_log(value, &pair_for(s, PAIR_LOGB)->B))
+			return 4;
+		break;
+
+	case OPT_NAMEA:
+		strncpy(pair_for(s, PAIR_NAMEA)->A.name, value,
+			sizeof(s->pairs->A.name) - 1);
+		break;
+
+	case OPT_NAMEB:
+		strncpy(pair_for(s, PAIR_NAMEB)->B.name, value,
+			sizeof(s->pairs->B.name) - 1);
+		break;
+
+	case OPT_WINDOW:
+		s->window_ms = atoi(value);
+		break;
+
+	case OPT_SPLICE:
+		s->use_splice = true;
+		if (value)
+			s->splice_sample = atoi(value);
+		if (s->splice_sample > CHUNK_SIZE)
+			s->splice_sample = CHUNK_SIZE;
+		break;
+
+	case OPT_URING:
+#ifdef HAVE_URING
+		s->uring_entries = value ? atoi(value) : 256;
+		if (s->uring_entries == 0)
+			return 3;
+		break;
+#else
+		fprintf(stderr, "Built without io_uring support\n");
+		return 3;
+#endif
+
+	case OPT_RING:
+		s->ring_size = (size_t)atoi(value) * 1024;
+		break;
+
+	case OPT_TIMESTAMPS:
+		s->timestamps = true;
+		break;
+
+	case OPT_CAPTURE:
+		if (!open_capture(s, value))
+			return 3;
+		break;
+
+	case OPT_READ:
+		s->read_file = strdup(value);
+		break;
+
+	case OPT_FROM:
+		s->read_from = atof(value);
+		break;
+
+	case OPT_TO:
+		s->read_to = atof(value);
+		break;
+
+	case OPT_ANALYZE:
+		s->analyze_file = strdup(value);
+		break;
+
+	case OPT_SESSION_GAP:
+		s->session_gap_ns = strtoull(value, NULL, 0) * 1000000ULL;
+		break;
+
+	case OPT_IDLE_GAP:
+		s->idle_gap_ns = strtoull(value, NULL, 0) * 1000000ULL;
+		break;
+
+	case OPT_COMPARE:
+		s->compare_file = strdup(value);
+		break;
+
+	case OPT_COMPARE_DIR:
+		s->compare_dir = (toupper(value[0]) == 'A') ?
+			CAP_DIR_A : CAP_DIR_B;
+		break;
+
+	case OPT_COMPARE_PAIR:
+		s->compare_pair = atoi(value);
+		break;
+
+	case OPT_COMPARE_SLACK:
+		s->compare_slack_ns = strtoull(value, NULL, 0) * 1000000ULL;
+		break;
+
+	case OPT_PCAPNG:
+		if (!open_pcapng(s, value))
+			return 3;
+		break;
+
+	case OPT_LINKTYPE:
+		s->pcapng_linktype = atoi(value);
+		break;
+
+	case OPT_REPLAY:
+		s->replay_file = strdup(value);
+		break;
+
+	case OPT_REPLAY_DIR:
+		s->replay_dir = (toupper(value[0]) == 'A') ?
+			CAP_DIR_A : CAP_DIR_B;
+		break;
+
+	case OPT_REPLAY_PAIR:
+		s->replay_pair = atoi(value);
+		break;
+
+	case OPT_SPEED:
+		s->replay_speed = STREQ(value, "max") ? 0 : atof(value);
+		break;
+
+	case OPT_LOCKSTEP:
+		s->lockstep = true;
+		break;
+
+	case OPT_EMULATE:
+		s->emulate = strdup(value);
+		break;
+
+	case OPT_IMAGE:
+		s->image_file = strdup(value);
+		break;
+
+	case OPT_SAVE:
+		s->save_file = strdup(value);
+		break;
+
+	case OPT_MEM_SIZE:
+		s->mem_size = strtoul(value, NULL, 0);
+		break;
+
+	case OPT_ACK_BLOCK:
+		s->ack_block = atoi(value) != 0;
+		break;
+
+	case OPT_MAGIC_LEN:
+		s->magic_len = atoi(value);
+		if ((s->magic_len < 1) || (s->magic_len > 64))
+			s->magic_len = 7;
+		break;
+
+	case OPT_MODEL:
+		if (parse_hex(value, s->icom_model,
+			      sizeof(s->icom_model)) != sizeof(s->icom_model))
+			return 3;
+		break;
+
+	case OPT_TTYA:
+		pair_for(s, PAIR_TTYA)->A.tty_spec = strdup(value);
+		break;
+
+	case OPT_TTYB:
+		pair_for(s, PAIR_TTYB)->B.tty_spec = strdup(value);
+		break;
+
+	case OPT_VPAIRS:
+		if (!open_vpairs(s, atoi(value)))
+			return 1;
+		break;
+
+	case OPT_STATE_FILE:
+		s->state_file = strdup(value);
+		break;
+
+	case OPT_FAULTA:
+		if (!parse_fault(value, &pair_for(s, PAIR_FAULTA)->A))
+			return 3;
+		break;
+
+	case OPT_FAULTB:
+		if (!parse_fault(value, &pair_for(s, PAIR_FAULTB)->B))
+			return 3;
+		break;
+
+	case OPT_OBSERVE:
+		if (!open_observe(s, value))
+			return 3;
+		break;
+
+	case OPT_OBSERVE_QUEUE:
+		s->observe.qmax = (size_t)atoi(value) * 1024;
+		break;
+
+	case OPT_DECODE:
+		s->decode = find_protocol(value);
+		if (!s->decode) {
+			fprintf(stderr, "Unknown protocol '%s'\n",
+				value);
+			return 3;
+		}
+		break;
+
+	case OPT_STATS:
+		s->stats_interval = atoi(value);
+		break;
+
+	case OPT_STATS_FILE:
+		s->stats_file = strdup(value);
+		break;
+
+	case OPT_ROTATE_SIZE:
+		s->rotate_size = parse_size(value);
+		break;
+
+	case OPT_ROTATE_TIME:
+		s->rotate_secs = atoi(value);
+		break;
+
+	case OPT_COMPRESS:
+		if (!STREQ(value, "gzip") && !STREQ(value, "zstd")) {
+			fprintf(stderr, "Unknown compressor '%s'\n",
+				value);
+			return 3;
+		}
+		s->compressor = strdup(value);
+		break;
+
+	case OPT_TRIGGER:
+		if (!parse_trigger(s, value))
+			return 3;
+		break;
+
+	case OPT_PRE_TRIGGER:
+		s->filter.pre_ns = strtoull(value, NULL, 0) * 1000000ULL;
+		break;
+
+	case OPT_POST_TRIGGER:
+		s->filter.post_ns = strtoull(value, NULL, 0) * 1000000ULL;
+		break;
+
+	case OPT_TRIGGER_BUFFER:
+		s->filter.size = (size_t)atoi(value) * 1024;
+		break;
+
+	case OPT_QUIESCENT:
+		s->quiescent = 1;
+		break;
+
+	case OPT_DIGITS:
+		s->total_hex=atoi(value);
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int ss_add_pair(struct ss_session *s, int fd_a, int fd_b)
+{
+	struct pair *pair = pair_for(s, PAIR_A | PAIR_B);
+
+	pair->A.fd = fd_a;
+	pair->B.fd = fd_b;
+	snprintf(pair->A.path, sizeof(pair->A.path), "fd %i", fd_a);
+	snprintf(pair->B.path, sizeof(pair->B.path), "fd %i", fd_b);
+
+	return s->npairs - 1;
+}
+
+void ss_set_chunk_callback(struct ss_session *s, ss_chunk_fn fn,
+			   void *opaque)
+{
+	s->chunk_fn = fn;
+	s->chunk_opaque = opaque;
+}
+
+void ss_set_pty_callback(struct ss_session *s, ss_pty_fn fn, void *opaque)
+{
+	s->pty_fn = fn;
+	s->pty_opaque = opaque;
+}
+
+void ss_catch_signals(struct ss_session *s, bool catch_signals)
+{
+	s->catch_signals = catch_signals;
+}
+
+void ss_stop(struct ss_session *s)
+{
+	uint64_t one = 1;
+
+	write(s->stop_fd, &one, sizeof(one));
+}
+
+int ss_run(struct ss_session *s)
+{
+	uint64_t stopped;
+	int ret = 0;
+	int i;
+
+	pthread_once(&hexdump_once, hexdump_init);
+
+	if (s->read_file)
+		return read_capture(s, s->read_file);
+
+	if (s->analyze_file)
+		return analyze_capture(s, s->analyze_file);
+
+	if (!s->replay_file && !s->emulate) {
+		if (s->npairs == 0)
+			return SS_EUSAGE;
+
+		for (i = 0; i < s->npairs; i++) {
+			struct pair *pair = &s->pairs[i];
+
+			if ((pair->A.fd < 0) || (pair->B.fd < 0))
+				return SS_EUSAGE;
+			if (pair->A.tty_spec && !setup_tty(&pair->A))
+				return 1;
+			if (pair->B.tty_spec && !setup_tty(&pair->B))
+				return 2;
+			if (s->decode && !pair->A.dec) {
+				pair->A.dec = calloc(1, sizeof(*pair->A.dec));
+				pair->B.dec = calloc(1, sizeof(*pair->B.dec));
+			}
+		}
+
+		if (s->compare_file && !compare_start(s))
+			return 1;
+	}
+
+	if ((s->catch_signals && !block_signals(s)) || !dump_start(s)) {
+		release_signals(s);
+		return SS_EFAIL;
+	}
+
+	/* However a mode ends, what it recorded is flushed the same way */
+	if (s->replay_file) {
+		ret = replay(s, s->replay_file);
+	} else if (s->emulate) {
+		ret = emulate_radio(s);
+	} else {
+		proxy(s);
+		if (s->state_file)
+			unlink(s->state_file);
+	}
+
+	sync_outputs(s);
+	stats_write(s);
+	dump_stop(s);
+	rotator_stop(s);
+	release_signals(s);
+
+	/* Whatever ss_stop() ended this run must not end the next */
+	read(s->stop_fd, &stopped, sizeof(stopped));
+
+	if (s->replay_file || s->emulate) {
+		fflush(stdout);
+		return ret;
+	}
+
+	printf("Final statistics:\n");
+	for (i = 0; i < s->npairs; i++) {
+		stats_print(&s->pairs[i].A);
+		stats_print(&s->pairs[i].B);
+		fault_report(&s->pairs[i].A);
+		fault_report(&s->pairs[i].B);
+	}
+	filter_report(s);
+	if (!compare_report(s))
+		ret = SS_EDIVERGED;
+
+	for (i = 0; i < s->npairs; i++) {
+		restore_tty(&s->pairs[i].A);
+		restore_tty(&s->pairs[i].B);
+	}
+	fflush(stdout);
+
+	return ret;
+}
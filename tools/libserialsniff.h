@@ -0,0 +1,130 @@
+/*
+ *
+ * Copyright 2008 Dan Smith <dsmith@danplanet.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libserialsniff: the serialsniff proxy engine, for embedding in test
+ * harnesses and benchmarks.  serialsniff(1) is a thin wrapper around
+ * it.
+ *
+ * A session is configured with the same options the command line
+ * takes (ss_set_option(s, "window", "10") is --window=10), and/or with
+ * pairs of already open descriptors, and then run until every pair has
+ * closed or ss_stop() is called.
+ *
+ * Each session holds all of its own state, so any number may exist at
+ * once, each run from its own thread.  A session may be run again once
+ * ss_run() has returned; pairs that closed stay closed.  Signal
+ * handling is process-wide, so --catch-signals is for one session at
+ * a time.
+ */
+
+#ifndef LIBSERIALSNIFF_H
+#define LIBSERIALSNIFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ss_session;
+
+enum {
+	SS_ARG_NONE,
+	SS_ARG_REQUIRED,
+	SS_ARG_OPTIONAL,
+};
+
+/* One of the options accepted by ss_set_option() */
+struct ss_option {
+	const char *name;
+	int has_arg;
+	int short_opt;		/* Command line shorthand, or 0 */
+};
+
+/* ss_run() results other than 0 or a positive exit status */
+#define SS_EUSAGE	-1	/* Nothing (or only half a pair) to proxy */
+#define SS_EFAIL	-2	/* The engine could not be started */
+
+/* ss_run() result when --compare found the live stream differs */
+#define SS_EDIVERGED	4
+
+/*
+ * Called from the forwarding thread for every chunk, once the line has
+ * been quiet for the coalescing window.  @data holds @len of the
+ * @count bytes read (fewer only in splice mode); @dir is 0 for the A
+ * side and 1 for B.  @ts_ns is on CLOCK_MONOTONIC_RAW: when epoll
+ * reported the first read readable (with --uring, its completion), or
+ * for sockets, when the kernel received it.
+ */
+typedef void (*ss_chunk_fn)(void *opaque, const char *name, int pair,
+			    int dir, uint64_t ts_ns, const void *data,
+			    size_t len, size_t count);
+
+/*
+ * Called with the slave's path whenever a pty is created: for a 'pty'
+ * path (with its name), for --replay ("client") and for --emulate
+ * ("radio").
+ */
+typedef void (*ss_pty_fn)(void *opaque, const char *name, const char *pts);
+
+const char *ss_version(void);
+
+/* NULL terminated */
+const struct ss_option *ss_options(void);
+
+struct ss_session *ss_session_new(void);
+void ss_session_free(struct ss_session *s);
+
+/*
+ * Returns 0, -1 for an unknown option or a missing value, or the
+ * positive status the command line exits with when the option cannot
+ * be applied.
+ */
+int ss_set_option(struct ss_session *s, const char *name, const char *value);
+
+/* Proxy between two open descriptors; returns the pair index or -1 */
+int ss_add_pair(struct ss_session *s, int fd_a, int fd_b);
+
+void ss_set_chunk_callback(struct ss_session *s, ss_chunk_fn fn,
+			   void *opaque);
+
+void ss_set_pty_callback(struct ss_session *s, ss_pty_fn fn, void *opaque);
+
+/*
+ * Stop cleanly on SIGINT, SIGTERM and SIGHUP, whatever ss_run() is
+ * doing.  They are blocked while it runs, and the caller's signal mask
+ * is restored when it returns.
+ */
+void ss_catch_signals(struct ss_session *s, bool catch_signals);
+
+int ss_run(struct ss_session *s);
+
+/*
+ * Safe to call from any thread, or from a signal handler.  Stops the
+ * proxy, the radio emulator or a replay.
+ */
+void ss_stop(struct ss_session *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
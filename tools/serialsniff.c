@@ -59,273 +59,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h>
-#include <fcntl.h>
-#include <sys/select.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
-#include <string.h>
-#include <signal.h>
 #include <getopt.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <arpa/inet.h>
 
-#define STREQ(a,b) (strcmp(a,b) == 0)
-
-char	*version = "1.02 (03 MAR 2009)";
-int	quiescent = 0;
-int	total_hex = 20;
-
-struct path {
-	int fd;
-	char path[1024];
-	char name[1024];
-	int rawlog_fd;
-};
-
-void hexdump(char *buf, int len, FILE *dest)
-{
-	/*
-	 * In precedence to the modification of this procedure to support the
-	 * variable size hexadecimal output, the total bytes output was fixed
-	 * to be a length of 8.
-	 *
-	 * The amendment of this procedure to support the "total_hex" variable
-	 * allows for the user to pass a command line argument instantiating a
-	 * desired number of hexadecimal bytes (and their ASCII equivelent) to
-	 * be displayed.
-	 *
-	 */
-
-	int i;
-	int j;
-
-	for (i = 0; i < len; i += total_hex) {
-		for (j = i; j < i + total_hex; j++) {
-			if ((j % 4) == 0)
-				fprintf(dest, " ");
-
-			if (j < len)
-				fprintf(dest, "%02x", buf[j] & 0xFF);
-			else
-				fprintf(dest, "--");
-		}
-
-		fprintf(dest, "   ");
-
-		for (j = i; j < i + total_hex; j++) {
-			if ((j % 4) == 0)
-				fprintf(dest, " ");
-
-			if (j > len)
-				fprintf(dest, ".");
-			else if ((buf[j] > ' ') && (buf[j] < '~'))
-				fprintf(dest, "%c", buf[j]);
-			else
-				fprintf(dest, ".");
-		}
-
-		fprintf(dest, "\n");
-	}
-}
-
-int saferead(int fd, char *buf, int len)
-{
-	struct itimerval val;
-	int ret;
-	int count = 0;
-
-	memset(&val, 0, sizeof(val));
-	val.it_value.tv_usec = 50000;
-	setitimer(ITIMER_REAL, &val, NULL);
-
-	while (count < len) {
-		getitimer(ITIMER_REAL, &val);
-		if ((val.it_value.tv_sec == 0) &&
-		    (val.it_value.tv_usec == 0)) {
-			if (!quiescent)
-				printf("Timeout\n"); 
-			break;
-		}
-
-		ret = read(fd, &(buf[count]), len - count);
-		if (ret > 0)
-			count += ret;
-	}
-
-	return count;
-}
-
-void proxy(struct path *pathA, struct path *pathB)
-{
-	fd_set rfds;
-	int ret;
-	struct timeval tv;
-
-	while (1) {
-		int count = 0;
-		int ret;
-		char buf[4096];
-
-		FD_ZERO(&rfds);
-
-		FD_SET(pathA->fd, &rfds);
-		FD_SET(pathB->fd, &rfds);
-
-		ret = select(30, &rfds, NULL, NULL, NULL);
-		if (ret == -1) {
-			perror("select");
-			break;
-		}
-
-		if (FD_ISSET(pathA->fd, &rfds)) {
-			count = saferead(pathA->fd, buf, sizeof(buf));
-			if (count < 0)
-				break;
-
-			ret = write(pathB->fd, buf, count);
-			if (ret != count)
-				printf("Failed to write %i (%i)\n", count, ret);
-			if (!quiescent)
-				printf("%s %i:\n", pathA->name, count);
-			hexdump(buf, count, stdout);
-
-			if (pathA->rawlog_fd >= 0) {
-				ret = write(pathA->rawlog_fd, buf, count);
-				if (ret != count)
-					printf("Failed to write %i to %s log",
-					       count,
-					       pathA->name);
-			}
-
-		}
-
-		if (FD_ISSET(pathB->fd, &rfds)) {
-			count = saferead(pathB->fd, buf, sizeof(buf));
-			if (count < 0)
-				break;
-
-			ret = write(pathA->fd, buf, count);
-			if (ret != count)
-				printf("Failed to write %i (%i)\n", count, ret);
-			if (!quiescent)
-				printf("%s %i:\n", pathB->name, count);
-			hexdump(buf, count, stdout);
-
-			if (pathB->rawlog_fd >= 0) {
-				ret = write(pathB->rawlog_fd, buf, count);
-				if (ret != count)
-					printf("Failed to write %i to %s log",
-					       count,
-					       pathB->name);
-			}
-		}
-	}
-}
-
-static bool open_pty(struct path *path)
-{
-#ifdef MACOS
-	char	*ptsname_path;
-#endif
-
-	path->fd = posix_openpt(O_RDWR);
-	if (path->fd < 0) {
-		perror("posix_openpt");
-		return false;
-	}
-
-	grantpt(path->fd);
-	unlockpt(path->fd);
-
-#ifdef MACOS
-	ptsname_path = ptsname(path->fd);
-	strncpy(path->path,ptsname_path,sizeof(path->path) - 1);
-#else
-	ptsname_r(path->fd, path->path, sizeof(path->path));
-#endif
-
-	fprintf(stderr, "%s\n", path->path);
-
-	return true;
-}
-
-static bool open_serial(const char *serpath, struct path *path)
-{
-	path->fd = open(serpath, O_RDWR);
-	if (path->fd < 0)
-		perror(serpath);
-
-	strncpy(path->path, serpath, sizeof(path->path));
-
-	return path->fd >= 0;
-}
-
-static bool open_socket(const char *foo, struct path *path)
-{
-	int lfd;
-	struct sockaddr_in srv;
-	struct sockaddr_in cli;
-	unsigned int cli_len = sizeof(cli);
-	int optval = 1;
-
-	lfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (lfd < 0) {
-		perror("socket");
-		return false;
-	}
-
-        srv.sin_family = AF_INET;
-        srv.sin_port = htons(2000);
-        srv.sin_addr.s_addr = INADDR_ANY;
-
-        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-        if (bind(lfd, (struct sockaddr *)&srv, sizeof(srv)) < 0) {
-                perror("bind");
-                return false;
-        }
-
-        if (listen(lfd, 1) < 0) {
-                perror("listen");
-		return false;
-        }
-
-	printf("Waiting...\n");
-
-	path->fd = accept(lfd, (struct sockaddr *)&cli, &cli_len);
-	if (path->fd < 0) {
-		perror("accept");
-		return false;
-	}
-
-	printf("Accepted socket client\n");
-
-	strcpy(path->path, "SOCKET");
-
-	return true;
-}
-
-static bool open_path(const char *opt, struct path *path)
-{
-	if (STREQ(opt, "pty"))
-		return open_pty(path);
-	else if (STREQ(opt, "listen"))
-		return open_socket(opt, path);
-	else
-		return open_serial(opt, path);
-}
-
-static bool open_log(const char *filename, struct path *path)
-{
-	path->rawlog_fd = open(filename, O_WRONLY | O_CREAT, 0644);
-	if (path->rawlog_fd < 0)
-		perror(filename);
-
-	return path->rawlog_fd >= 0;
-}
+#include "libserialsniff.h"
 
 static void usage()
 {
@@ -333,12 +69,95 @@ static void usage()
 	       "serialsniff [OPTIONS]\n"
 	       "Where OPTIONS are:\n"
 	       "\n"
-	       "      -A,--pathA=DEV 	Path to device A (or 'pty')\n"
+	       "      -A,--pathA=DEV 	Path to device A (or 'pty', or\n"
+	       "                 	'listen[:[ADDR:]PORT]', default port 2000)\n"
+	       "                 	(repeat -A/-B to proxy several pairs)\n"
 	       "      -B,--pathB=DEV 	Path to device B (or 'pty')\n"
+	       "         --vpairs=N	Add N pairs with a pty at each end\n"
+	       "         --state-file=FILE	Write every pair's paths to FILE\n"
+	       "                 	(as JSON) once they are all forwarding\n"
 	       "         --logA=FILE 	Log pathA (raw) to FILE\n"
 	       "         --logB=FILE 	Log pathB (raw) to FILE\n"
+	       "         --rotate-size=N	Rotate raw logs after N bytes\n"
+	       "                 	(k, M or G suffix allowed)\n"
+	       "         --rotate-time=SECS	Rotate raw logs every SECS\n"
+	       "         --compress=PROG	Compress rotated logs with gzip\n"
+	       "                 	or zstd\n"
+	       "         --ttyA=SPEC	Set up pathA's line discipline; SPEC is\n"
+	       "                 	a comma separated list of a baud rate\n"
+	       "                 	(any, e.g. 38400 or 250000), 8N1/7E2..,\n"
+	       "                 	raw, vmin=N, vtime=N and lowlatency\n"
+	       "         --ttyB=SPEC	Set up pathB's line discipline\n"
+	       "         --faultA=SPEC	Inject faults into data read from\n"
+	       "                 	pathA on its way to pathB; SPEC is a\n"
+	       "                 	comma separated list of delay=MS,\n"
+	       "                 	jitter=MS, drop=P, flip=P (per byte\n"
+	       "                 	probability, e.g. 0.01 or 1%%),\n"
+	       "                 	baud=N and seed=N\n"
+	       "         --faultB=SPEC	Inject faults into data from pathB\n"
 	       "         --nameA=NAME	Set pathA name to NAME\n"
 	       "         --nameB=NAME	Set pathB name to NAME\n"
+	       "         --window=MS	Coalesce reads for display over MS\n"
+	       "                 	milliseconds (default 50, 0 to disable)\n"
+	       "         --splice[=N]	Forward and log with splice()/tee(),\n"
+	       "                 	showing only the first N bytes of each\n"
+	       "                 	chunk (default 64)\n"
+	       "         --uring[=N]	Read, forward and log through an\n"
+	       "                 	io_uring of N entries (default 256)\n"
+	       "                 	instead of epoll; disables --splice\n"
+	       "         --ring=KB	Buffer up to KB of chunks for display\n"
+	       "                 	before dropping them (default 1024)\n"
+	       "  -t,--timestamps	Show when each chunk started\n"
+	       "         --observe=[ADDR:]PORT	Accept any number of observers\n"
+	       "                 	and mirror all pairs to them\n"
+	       "         --observe-queue=KB	Per-observer queue (default 256)\n"
+	       "         --decode=PROTO	Decode frames as well as dumping them\n"
+	       "                 	(icom, baofeng or kenwood)\n"
+	       "         --stats=SECS	Print a statistics summary every SECS\n"
+	       "         --stats-file=FILE	Keep JSON statistics in FILE\n"
+	       "                 	(rewritten every --stats interval,\n"
+	       "                 	or every second)\n"
+	       "         --trigger=EXPR	Only record traffic around reads\n"
+	       "                 	matching EXPR (may be repeated):\n"
+	       "                 	dir=A|B,pattern=HEX,len=MIN[-MAX]\n"
+	       "                 	?? in a pattern matches any byte\n"
+	       "         --pre-trigger=MS	Keep MS before a trigger (1000)\n"
+	       "         --post-trigger=MS	Keep MS after a trigger (1000)\n"
+	       "         --trigger-buffer=KB	Pre-trigger buffer (default 1024)\n"
+	       "         --capture=FILE	Record both directions of all pairs,\n"
+	       "                 	with timestamps, to FILE\n"
+	       "         --pcapng=FILE	Record all pairs to FILE in pcapng format\n"
+	       "         --linktype=N	pcapng link type (default 147, USER0)\n"
+	       "         --read=FILE	Print a capture FILE and exit\n"
+	       "         --from=SEC	Start --read SEC seconds into the capture\n"
+	       "         --to=SEC	Stop --read SEC seconds into the capture\n"
+	       "         --analyze=FILE	Split a capture FILE into clone sessions\n"
+	       "                 	and time their phases (ident, read,\n"
+	       "                 	ack, upload), honouring --from/--to\n"
+	       "         --session-gap=MS	Silence that ends a session (2000)\n"
+	       "         --idle-gap=MS	Silence counted as idle (default 100)\n"
+	       "         --compare=FILE	Check one side of a pair against a\n"
+	       "                 	golden capture FILE as it is proxied,\n"
+	       "                 	reporting the first difference and how\n"
+	       "                 	far behind it is (exits 4 if it differs)\n"
+	       "         --compare-dir=A|B	Side to check (default A)\n"
+	       "         --compare-pair=N	Pair to check (default 0)\n"
+	       "         --compare-slack=MS	Fail if more than MS behind the\n"
+	       "                 	golden capture (default 500, 0 to ignore)\n"
+	       "         --replay=FILE	Play one side of a capture into a pty\n"
+	       "         --replay-dir=A|B	Side to play (default B)\n"
+	       "         --replay-pair=N	Pair to play (default 0)\n"
+	       "         --speed=X	Replay X times faster (or 'max')\n"
+	       "         --lockstep	Wait for the client's recorded bytes\n"
+	       "                 	before each replayed chunk\n"
+	       "         --emulate=PROTO	Act as a radio on a pty, answering\n"
+	       "                 	'baofeng' or 'icom' clone requests\n"
+	       "         --image=FILE	Radio image to serve\n"
+	       "         --save=FILE	Save the image after each upload\n"
+	       "         --mem-size=N	Baofeng memory size (default 0x2000)\n"
+	       "         --ack-block=0|1	Baofeng ACK before blocks (default 1)\n"
+	       "         --magic-len=N	Baofeng magic length (default 7)\n"
+	       "         --model=HEX	Icom model (default 20880001)\n"
 	       "  --q,-q,--quiescent	Run in quiescent mode\n"
 	       "  --d,-d,--digits	Number of hex digits to print in one line\n\n"
 	       "  --d=nn or -d nn or --digits nn\n"
@@ -348,93 +167,63 @@ static void usage()
 
 int main(int argc, char **argv)
 {
+	const struct ss_option *opts = ss_options();
+	struct option *lopts;
+	struct ss_session *s;
+	int nopts;
+	int ret;
+	int c;
+	int i;
 
-	struct sigaction sa;
-
-	struct path pathA;
-	struct path pathB;
+	printf("\nserialsniff - Version %s\n\n", ss_version());
 
-	int c;
+	for (nopts = 0; opts[nopts].name; nopts++)
+		;
 
-	strcpy(pathA.name, "A");
-	strcpy(pathB.name, "B");
-	pathA.fd = pathA.rawlog_fd = -1;
-	pathB.fd = pathB.rawlog_fd = -1;
+	/* Long-only options are numbered past the single characters */
+	lopts = calloc(nopts + 1, sizeof(*lopts));
+	if (!lopts)
+		return -1;
+	for (i = 0; i < nopts; i++) {
+		lopts[i].name = opts[i].name;
+		lopts[i].has_arg = opts[i].has_arg;
+		lopts[i].val = opts[i].short_opt ? opts[i].short_opt : 256 + i;
+	}
 
-	printf("\nserialsniff - Version %s\n\n",version);
+	s = ss_session_new();
+	if (!s)
+		return -1;
 
 	while (1) {
-		int optind;
-		static struct option lopts[] = {
-			{"pathA", 1, 0, 'A'},
-			{"pathB", 1, 0, 'B'},
-			{"logA",  1, 0, 1 },
-			{"logB",  1, 0, 2 },
-			{"nameA", 1, 0, 3 },
-			{"nameB", 1, 0, 4 },
-			{"quiescent", 0, 0, 'q' },
-			{"digits", 1, 0, 'd'},
-			{0, 0, 0, 0}
-		};
-
-		c = getopt_long(argc, argv, "A:B:d:l:q",
-				lopts, &optind);
+		c = getopt_long(argc, argv, "A:B:d:l:qt", lopts, NULL);
 		if (c == -1)
 			break;
-
-		switch (c) {
-
-		case 'A':
-			if (!open_path(optarg, &pathA))
-				return 1;
-			break;
-
-		case 'B':
-			if (!open_path(optarg, &pathB))
-				return 2;
-			break;
-
-		case 1:
-			if (!open_log(optarg, &pathA))
-				return 3;
-			break;
-
-		case 2:
-			if (!open_log(optarg, &pathB))
-				return 4;
-			break;
-
-		case 3:
-			strncpy(pathA.name, optarg, sizeof(pathA.name));
-			break;
-
-		case 4:
-			strncpy(pathB.name, optarg, sizeof(pathB.name));
-			break;
-
-		case 'q':
-			quiescent = 1;
-			break;
-
-		case 'd':
-			total_hex=atoi(optarg);
-			break;
-
-		case '?':
+		if (c == '?')
 			return 3;
+
+		if (c >= 256) {
+			i = c - 256;
+		} else {
+			for (i = 0; i < nopts; i++)
+				if (opts[i].short_opt == c)
+					break;
+			if (i == nopts)
+				continue;
 		}
+
+		ret = ss_set_option(s, opts[i].name, optarg);
+		if (ret)
+			return ret;
 	}
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = SIG_IGN;
-	sigaction(SIGALRM, &sa, NULL);
+	ss_catch_signals(s, true);
 
-	if ((pathA.fd < 0) || (pathB.fd < 0)) {
+	ret = ss_run(s);
+	if (ret == SS_EUSAGE)
 		usage();
-		return -1;
-	}
 
-	proxy(&pathA, &pathB);
+	ss_session_free(s);
+	free(lopts);
 
-	return 0;
+	return ret;
 }
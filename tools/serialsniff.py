@@ -0,0 +1,214 @@
+# Copyright 2008 Dan Smith <dsmith@danplanet.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""ctypes binding for libserialsniff, the serialsniff proxy engine.
+
+This lets tests run the proxy, the radio emulator or a replay in-process:
+
+    with serialsniff.Session(emulate='baofeng', image='radio.img') as s:
+        port = s.pty('radio')
+        ...drive a radio on port...
+
+or give each test a bridged pair of ptys of its own:
+
+    with serialsniff.Session(vpairs=1) as s:
+        ...open s.pty('A') and s.pty('B'), one at each end...
+
+Options are the command line's long options, with '_' for '-'.  Any
+number of Sessions may exist at once, and each may be started again
+once it has stopped.
+"""
+
+import ctypes
+import os
+import threading
+
+LIBNAME = 'libserialsniff.so'
+
+_lib = None
+
+# ss_run() result when the live stream differs from a --compare capture
+SS_EDIVERGED = 4
+
+_CHUNK_FN = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_char_p,
+                             ctypes.c_int, ctypes.c_int, ctypes.c_uint64,
+                             ctypes.c_void_p, ctypes.c_size_t,
+                             ctypes.c_size_t)
+_PTY_FN = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_char_p,
+                           ctypes.c_char_p)
+
+
+class SerialSniffError(Exception):
+    pass
+
+
+def find_library():
+    """Return the path of the shared library, or None if it is not built"""
+    path = os.environ.get('SERIALSNIFF_LIB',
+                          os.path.join(os.path.dirname(
+                              os.path.abspath(__file__)), LIBNAME))
+    if os.path.exists(path):
+        return path
+    return None
+
+
+def load():
+    global _lib
+
+    if _lib:
+        return _lib
+
+    path = find_library()
+    if not path:
+        raise SerialSniffError('%s is not built (run make in tools/)' %
+                               LIBNAME)
+
+    lib = ctypes.CDLL(path)
+    lib.ss_version.restype = ctypes.c_char_p
+    lib.ss_session_new.restype = ctypes.c_void_p
+    lib.ss_session_free.argtypes = [ctypes.c_void_p]
+    lib.ss_set_option.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                                  ctypes.c_char_p]
+    lib.ss_add_pair.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    lib.ss_set_chunk_callback.argtypes = [ctypes.c_void_p, _CHUNK_FN,
+                                          ctypes.c_void_p]
+    lib.ss_set_pty_callback.argtypes = [ctypes.c_void_p, _PTY_FN,
+                                        ctypes.c_void_p]
+    lib.ss_run.argtypes = [ctypes.c_void_p]
+    lib.ss_stop.argtypes = [ctypes.c_void_p]
+    _lib = lib
+
+    return lib
+
+
+def _bytes(value):
+    if isinstance(value, bytes):
+        return value
+    return str(value).encode()
+
+
+class Chunk(object):
+    """A chunk of data read from one side of a pair.
+
+    @data is a memoryview straight onto the engine's buffer, which is
+    only valid during the callback; use chunk.data.tobytes() to keep it.
+    """
+
+    def __init__(self, name, pair, direction, timestamp, data, count):
+        self.name = name
+        self.pair = pair
+        self.direction = direction
+        self.timestamp = timestamp
+        self.data = data
+        self.count = count
+
+
+class Session(object):
+    def __init__(self, **options):
+        self._lib = load()
+        self._session = self._lib.ss_session_new()
+        if not self._session:
+            raise SerialSniffError('Unable to create a session')
+
+        self._thread = None
+        self._result = None
+        self._chunk_handlers = []
+        self._ptys = {}
+        self._pty_event = threading.Condition()
+
+        # Keep references to the callbacks for as long as C has them
+        self._chunk_cb = _CHUNK_FN(self._on_chunk)
+        self._pty_cb = _PTY_FN(self._on_pty)
+        self._lib.ss_set_chunk_callback(self._session, self._chunk_cb, None)
+        self._lib.ss_set_pty_callback(self._session, self._pty_cb, None)
+
+        try:
+            for name, value in options.items():
+                self.set_option(name.replace('_', '-'), value)
+        except SerialSniffError:
+            self.close()
+            raise
+
+    def set_option(self, name, value=None):
+        if value is True:
+            value = None
+        elif value is not None:
+            value = _bytes(value)
+        ret = self._lib.ss_set_option(self._session, _bytes(name), value)
+        if ret != 0:
+            raise SerialSniffError('Unable to set %s=%s (%i)' %
+                                   (name, value, ret))
+
+    def add_pair(self, fd_a, fd_b):
+        """Proxy between two open descriptors, which the session owns"""
+        return self._lib.ss_add_pair(self._session, fd_a, fd_b)
+
+    def on_chunk(self, handler):
+        """Call handler(Chunk) from the engine thread for every chunk"""
+        self._chunk_handlers.append(handler)
+
+    def _on_chunk(self, opaque, name, pair, direction, timestamp, data,
+                  length, count):
+        buf = (ctypes.c_char * length).from_address(data)
+        chunk = Chunk(name.decode(), pair, direction, timestamp,
+                      memoryview(buf), count)
+        for handler in self._chunk_handlers:
+            handler(chunk)
+
+    def _on_pty(self, opaque, name, pts):
+        with self._pty_event:
+            self._ptys[name.decode()] = pts.decode()
+            self._pty_event.notify_all()
+
+    def pty(self, name, timeout=5):
+        """Wait for the pty called @name to be created and return it"""
+        with self._pty_event:
+            if name not in self._ptys:
+                self._pty_event.wait(timeout)
+            if name not in self._ptys:
+                raise SerialSniffError('No pty %s' % name)
+            return self._ptys[name]
+
+    def start(self):
+        """Run the engine on a background thread"""
+        def run():
+            self._result = self._lib.ss_run(self._session)
+
+        self._thread = threading.Thread(target=run)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def stop(self, timeout=10):
+        """Stop the engine and return ss_run()'s result"""
+        if self._thread:
+            self._lib.ss_stop(self._session)
+            self._thread.join(timeout)
+            if self._thread.is_alive():
+                raise SerialSniffError('Engine did not stop')
+            self._thread = None
+        return self._result
+
+    def close(self):
+        self.stop()
+        if self._session:
+            self._lib.ss_session_free(self._session)
+            self._session = None
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.close()